@@ -2,11 +2,29 @@
 #include <stdio.h>
 #include <math.h>
 #include <memory.h>
+#include <string.h>
+#include <stdlib.h>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define HAVE_X86_SIMD
+#include <emmintrin.h>
+#include <immintrin.h>
+
+//GCC wants per-function permission to emit instructions beyond the baseline
+#ifdef __GNUC__
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define TARGET_SSE2
+#define TARGET_AVX2
+#endif
+#endif
 
 #define SCREEN_WIDTH 640
 #define SCREEN_HEIGHT 480
 #define SCREEN_PIXELS SCREEN_WIDTH * SCREEN_HEIGHT
 #define SCREEN_DEPTH 5.0
+#define NEAR_Z 0.1
 
 //Convert a point scaled such that 1.0, 1.0 is at the upper right-hand
 //corner of the screen and -1.0, -1.0 is at the bottom right to pixel coords
@@ -16,8 +34,226 @@
 #define TO_SCREEN_Z(z) ((unsigned short)((z) > SCREEN_DEPTH || z < 0 ? 65535 : ((z*65535.0)/SCREEN_DEPTH)))
 #define DEG_TO_RAD(a) ((((float)a)*PI)/180.0)
 
+//Pack an 8-bit rgb triple into a pixel of the 32-bit ARGB8888 framebuffer
+#define TO_PIXEL(r, g, b) ((unsigned int)(0xFF000000 | (((unsigned int)(r)) << 16) | (((unsigned int)(g)) << 8) | ((unsigned int)(b))))
+
+//Triangle fill engines, switchable at runtime
+#define RASTER_SCANLINE 0
+#define RASTER_EDGE 1
+#define RASTER_EDGE_TABLE 2
+#define RASTER_MODE_COUNT 3
+
+//How static scenery has its hidden surfaces removed, also switchable at
+//runtime. Everything else always goes through the z-buffer
+#define HSR_ZBUF 0
+#define HSR_SPANS 1
+#define HSR_MODE_COUNT 2
+
+//Whether triangles are shaded as they're drawn or only once visibility has
+//been resolved for the whole frame. In the visibility buffer mode the
+//framebuffer holds triangle ids until then, all of them below this. Pixels
+//always have an alpha of 0xFF, so the two can't be mixed up
+#define SHADE_FORWARD 0
+#define SHADE_DEFERRED 1
+#define SHADE_MODE_COUNT 2
+#define VIS_ID_LIMIT 0xFF000000
+
+//Whether untextured triangles are lit once for the whole face, or at each
+//vertex with the colors blended across the face
+#define LIGHT_FLAT 0
+#define LIGHT_GOURAUD 1
+#define LIGHT_MODE_COUNT 2
+
+//Size of the square pixel blocks the edge-function engine accepts or rejects
+//as a whole. Both screen dimensions must be a multiple of this
+#define BLOCK_SIZE 8
+
+//The framebuffer and z-buffer are also tracked in tiles of the same size so
+//that clearing them can be deferred until a tile is actually drawn into
+#define TILES_X (SCREEN_WIDTH / BLOCK_SIZE)
+#define TILES_Y (SCREEN_HEIGHT / BLOCK_SIZE)
+#define TILE_COUNT (TILES_X * TILES_Y)
+
+//Triangles are sorted into square screen bins before being rasterized, and
+//each bin is then drawn start to finish by a single thread. Must be a
+//multiple of BLOCK_SIZE so that no tile is shared between two bins
+#define BIN_SIZE 32
+#define BINS_X ((SCREEN_WIDTH + BIN_SIZE - 1) / BIN_SIZE)
+#define BINS_Y ((SCREEN_HEIGHT + BIN_SIZE - 1) / BIN_SIZE)
+#define BIN_COUNT (BINS_X * BINS_Y)
+#define MAX_WORKERS 128
+
+//Merging touching spans leaves at least a pixel between any two, so this many
+//is as many as a bin's width of scanline can ever hold
+#define SPAN_LIST_MAX (BIN_SIZE / 2 + 1)
+
+//Triangles go through lighting and projection this many at a time
+#define SETUP_BATCH 8
+
+//Setups per link of a bin's chain
+#define BIN_CHUNK 32
+
+//The most attributes an interpolator carries, and where a triangle edge's
+//screen x and depth sit among them
+#define INTERP_MAX_ATTRS 8
+#define EDGE_X 0
+#define EDGE_Z 1
+#define EDGE_ATTRS 2
+
+//Arena allocations are all aligned to this, which is enough for any vector
+//load, and arenas grow by blocks of at least these sizes
+#define ARENA_ALIGN 16
+#define SCENE_ARENA_BLOCK (64 * 1024)
+#define FRAME_ARENA_BLOCK (256 * 1024)
+
+//Outcodes, saying which planes of the view frustum a clip space vertex is
+//outside of. A triangle with all three vertices outside the same plane can't
+//be seen
+#define OUT_NEAR 1
+#define OUT_FAR 2
+#define OUT_LEFT 4
+#define OUT_RIGHT 8
+#define OUT_BOTTOM 16
+#define OUT_TOP 32
+
+//The sides of the frustum are only clipped against once a vertex is out past
+//a wider guard band, this many times the size of the screen. Anything short
+//of that is left for the rasterizers to scissor, which costs nothing extra,
+//while the band still keeps screen coordinates small enough for the edge
+//functions
+#define GUARD_BAND 4.0
+#define GUARD_LEFT 64
+#define GUARD_RIGHT 128
+#define GUARD_BOTTOM 256
+#define GUARD_TOP 512
+#define OUT_REJECT (OUT_NEAR | OUT_FAR | OUT_LEFT | OUT_RIGHT | OUT_BOTTOM | OUT_TOP)
+#define OUT_CLIP (OUT_NEAR | OUT_FAR | GUARD_LEFT | GUARD_RIGHT | GUARD_BOTTOM | GUARD_TOP)
+#define CLIP_PLANE_COUNT 6
+
+//How a bounding volume sits against the view frustum
+#define FRUSTUM_OUTSIDE 0
+#define FRUSTUM_PARTIAL 1
+#define FRUSTUM_INSIDE 2
+
+//Scene hierarchy leaves hold up to this many objects, and traversals keep
+//their pending nodes on a stack this deep
+#define BVH_LEAF_SIZE 4
+#define BVH_STACK 64
+
+//While walking the scene, once this many triangles are waiting in the bins
+//they get drawn so that the hierarchical z has something to reject the rest
+//of the scene against
+#define OCCLUSION_FLUSH 4096
+
+//Distance from a BSP splitting plane inside which a vertex counts as on it,
+//and how many candidate splitters the compiler scores at each node. A split
+//costs this much more than a triangle of imbalance between the two sides
+#define BSP_EPSILON 0.0001
+#define BSP_CANDIDATES 16
+#define BSP_SPLIT_COST 8
+
+//Identifies a compiled BSP file, and which layout it's in
+#define BSP_MAGIC "LBSP"
+#define BSP_VERSION 4
+
+//Portals between sectors are convex polygons of at most this many vertices.
+//Neither the offline visibility flood nor the runtime portal walk goes more
+//than this many portals deep
+#define PORTAL_MAX_VERTS 8
+#define SECTOR_MAX_DEPTH 32
+
+//Identifies a compiled sector map file, and which layout it's in
+#define SECTOR_MAGIC "LSEC"
+#define SECTOR_VERSION 1
+
+//Clipping a convex polygon to a plane adds at most one vertex to it
+#define CLIP_MAX_VERTS (3 + CLIP_PLANE_COUNT)
+
+//The attributes carried by a vertex through the clipper, every one of which is
+//interpolated the same way along a clipped edge
+#define ATTR_X 0
+#define ATTR_Y 1
+#define ATTR_Z 2
+#define ATTR_U 3
+#define ATTR_V 4
+#define ATTR_R 5
+#define ATTR_G 6
+#define ATTR_B 7
+#define CLIP_ATTRS 8
+
+//Textures are stored as 4x4 blocks of texels, each block's sixteen texels
+//together in memory, so that sampling a small area stays within a cache line
+//or two whichever way it's walked. Mip levels stop at a single block, and
+//textures are registered in a table so that levels can refer to them by id
+#define TEX_BLOCK_SHIFT 2
+#define TEX_MAX_LEVELS 16
+#define MAX_TEXTURES 256
+#define TEX_BLOCK_INDEX(x, y, w_shift) \
+    (((((y) >> TEX_BLOCK_SHIFT) << ((w_shift) - TEX_BLOCK_SHIFT)) + ((x) >> TEX_BLOCK_SHIFT)) << (2 * TEX_BLOCK_SHIFT) | \
+     (((y) & ((1 << TEX_BLOCK_SHIFT) - 1)) << TEX_BLOCK_SHIFT) | ((x) & ((1 << TEX_BLOCK_SHIFT) - 1)))
+
+//Texture coordinates are worked out exactly, with a divide, only every this
+//many pixels along a span, and stepped linearly in between
+#define TEX_SUBSPAN 16
+
+//Scale a texel by a light level out of 256
+#define TEX_MODULATE(t, l) TO_PIXEL(((((t) >> 16) & 0xFF) * (l)) >> 8, ((((t) >> 8) & 0xFF) * (l)) >> 8, (((t) & 0xFF) * (l)) >> 8)
+
+//Lit copies of environment textures are kept for up to this many bytes of
+//texels, and are only rebuilt when a surface's light level moves to another
+//multiple of SURFACE_LIGHT_STEP
+#define SURFACE_CACHE_BYTES (4 * 1024 * 1024)
+#define SURFACE_HASH_SIZE 1024
+#define SURFACE_LIGHT_STEP 8
+
+//How lit a surface is, out of 1, from the cosine of the angle between its
+//normal and the direction to the camera. Full on facing the camera, half
+//edge-on and nothing facing directly away
+#define LIGHT_FROM_COS(c) (0.5 + 0.5 * ((c) > 1.0 ? 1.0 : (c) < -1.0 ? -1.0 : (c)))
+
+//Depth-test and write a run of count pixels starting at framebuffer offset
+//addr, with depth starting at z and changing by dz per pixel
+typedef void (*span_func)(int addr, int count, float z, float dz, unsigned int pixel);
+
+//The same for a run whose color changes along it. c holds the red, green and
+//blue of the first pixel and dc their change per pixel, all in 16.16 fixed
+//point. The depth test is skipped, as for store_span, unless test is set
+typedef void (*gouraud_func)(int addr, int count, float z, float dz, int *c, int *dc, int test);
+
 float focal_length;
 unsigned short *zbuf;
+unsigned int *fbuf;
+int raster_mode = RASTER_SCANLINE;
+char *raster_mode_name[RASTER_MODE_COUNT] = {"scanline", "edge", "edge table"};
+int hsr_mode = HSR_ZBUF;
+char *hsr_mode_name[HSR_MODE_COUNT] = {"z-buffer", "span buffer"};
+int shade_mode = SHADE_FORWARD;
+char *shade_mode_name[SHADE_MODE_COUNT] = {"forward", "visibility buffer"};
+int light_mode = LIGHT_GOURAUD;
+char *light_mode_name[LIGHT_MODE_COUNT] = {"flat", "gouraud"};
+
+//A tile is valid for the current frame only if its epoch matches the frame's.
+//Clean tiles already hold the clear color and the far plane
+unsigned int frame_epoch = 1;
+unsigned int clear_pixel;
+unsigned int tile_epoch[TILE_COUNT];
+unsigned char tile_clean[TILE_COUNT];
+
+//Hierarchical z: conservative bounds on the depth values inside each tile.
+//Depth only ever gets nearer during a frame, so the max stays a valid upper
+//bound without being recomputed and only tightens when a triangle covers a
+//whole tile, while the min has to drop with every write
+unsigned short tile_zmin[TILE_COUNT];
+unsigned short tile_zmax[TILE_COUNT];
+
+//How many pixels of the triangle being scanned fell in each tile
+unsigned char tile_cover[TILE_COUNT];
+
+//Every triangle set up this frame in the visibility buffer mode, by id. An
+//int count can never reach VIS_ID_LIMIT
+struct tri_setup **vis_setups = NULL;
+int vis_count = 0;
+int vis_cap = 0;
 
 typedef struct point {
     float x;
@@ -37,17 +273,84 @@ typedef struct color {
     unsigned char a;
 } color;
 
+//A mip-mapped texture. Level 0 is 1 << w_shift[0] by 1 << h_shift[0]
+//texels, every level after it is half the size of the one before, and each
+//is laid out in blocks by TEX_BLOCK_INDEX
+typedef struct texture {
+    int id;
+    int levels;
+    int w_shift[TEX_MAX_LEVELS];
+    int h_shift[TEX_MAX_LEVELS];
+    unsigned int *texels[TEX_MAX_LEVELS];
+} texture;
+
+//nx, ny and nz are the vertex normal, in the same space as the position.
+//r, g and b are the vertex's lit color, once it's been lit
 typedef struct vertex {
     float x;
     float y;
     float z;
+    float u;
+    float v;
+    float nx;
+    float ny;
+    float nz;
+    float r;
+    float g;
+    float b;
     color *c;
 } vertex;
 
+//tex is NULL for triangles that are just filled with their color. surface
+//identifies the environment face a triangle was cut from, and is -1 for
+//anything that isn't part of the environment. nx, ny and nz are the face
+//normal, in the same space as the vertices
 typedef struct triangle {
     vertex v[3];
+    texture *tex;
+    int surface;
+    float nx;
+    float ny;
+    float nz;
 } triangle;
 
+//A triangle of a mesh, as indices into the object's vertex array. Texture
+//coordinates belong to the corners of faces rather than to the vertices,
+//since faces meeting at a vertex rarely agree on them. nx, ny and nz are the
+//face's unit normal in object space, worked out once when the mesh is built
+typedef struct face {
+    int v[3];
+    float uv[3][2];
+    float nx;
+    float ny;
+    float nz;
+} face;
+
+//A vertex of a mesh after it's been through the current transform, kept so
+//that every face sharing it can reuse the work. Only valid while stamp
+//matches the object's xform_stamp
+typedef struct xvertex {
+    vertex v;
+    screen_point p;
+    unsigned short outcode;
+    unsigned int stamp;
+} xvertex;
+
+//One of the planes triangles get clipped to, as the outcode bit it goes with
+//and a*x + b*y + c*z + d, which is negative on the outside
+typedef struct clip_plane {
+    int bit;
+    float a;
+    float b;
+    float c;
+    float d;
+} clip_plane;
+
+//A vertex of the polygon being clipped, as a plain array of attributes
+typedef struct clip_vertex {
+    float a[CLIP_ATTRS];
+} clip_vertex;
+
 typedef struct node {
     void *payload;
     struct node *next;
@@ -57,15 +360,372 @@ typedef struct list {
     node *root;
 } list;
 
+//Row-major 4x4 transform, applied to column vectors
+typedef struct matrix {
+    float m[4][4];
+} matrix;
+
+//A sphere, by its center and radius
+typedef struct sphere {
+    float c[3];
+    float r;
+} sphere;
+
+//An axis-aligned box
+typedef struct box {
+    float min[3];
+    float max[3];
+} box;
+
+//Meshes are stored in the object's own space and only ever placed in the
+//world by its model matrix. x, y and z track where its origin ended up.
+//faces index into verts, and xform is the post-transform cache for those
+//same vertices. Both arrays grow by doubling. bounds and bound_sphere enclose
+//the mesh in object space, and the world_ versions follow them through the
+//model matrix whenever it changes
 typedef struct object {
-    list tri_list;
+    texture *tex;
+    face *faces;
+    int face_count;
+    int face_cap;
+    vertex *verts;
+    xvertex *xform;
+    int vert_count;
+    int vert_cap;
+    unsigned int xform_stamp;
     float x;
     float y;
     float z;
+    matrix model;
+    box bounds;
+    sphere bound_sphere;
+    box world_bounds;
+    sphere world_sphere;
 } object;
 
+//A node of the bounding volume hierarchy over a scene's objects. Leaves have a
+//count and cover order[first] to order[first + count - 1], and everything
+//else has two children, both at higher indices than the node itself
+typedef struct bvh_node {
+    box bounds;
+    int left;
+    int right;
+    int first;
+    int count;
+} bvh_node;
+
+//Every object in a scene, and the hierarchy over them. The hierarchy is built
+//the first time it's needed after objects are added, and after that just has
+//its bounds refit to wherever the objects have moved
+typedef struct scene {
+    object **objects;
+    int object_count;
+    int object_cap;
+    int *order;
+    bvh_node *nodes;
+    int node_count;
+} scene;
+
+//A node of a compiled BSP tree. plane is a*x + b*y + c*z + d, positive on
+//the front side. The triangles lying in the plane are tris[first] onward,
+//front_count of them facing the same way as the plane followed by back_count
+//facing the other way. bounds holds everything in the subtree, and front and
+//back are -1 when there's nothing on that side
+typedef struct bsp_node {
+    float plane[4];
+    box bounds;
+    int first;
+    int front_count;
+    int back_count;
+    int front;
+    int back;
+} bsp_node;
+
+//Static environment geometry, compiled into a BSP in world space. Its
+//triangles' surfaces are numbered from first_surface, surface_count of them
+typedef struct bsp_tree {
+    bsp_node *nodes;
+    int node_count;
+    int node_cap;
+    triangle *tris;
+    int tri_count;
+    int tri_cap;
+    int first_surface;
+    int surface_count;
+} bsp_tree;
+
+//An opening from one sector into another. Every opening is stored once for
+//each direction it can be looked through. plane is positive on the to side
+typedef struct portal {
+    float v[PORTAL_MAX_VERTS][3];
+    int count;
+    float plane[4];
+    int from;
+    int to;
+} portal;
+
+//A convex region of a level, holding its own static geometry. Its portals
+//out are portals[first_portal] onward once the map's been compiled
+typedef struct sector {
+    box bounds;
+    bsp_tree geometry;
+    int first_portal;
+    int portal_count;
+} sector;
+
+//A level split into sectors joined by portals. pvs has a row of pvs_stride
+//bytes per sector, with bit n of a row set when sector n might be visible
+//from somewhere in that row's sector
+typedef struct sector_map {
+    sector *sectors;
+    int sector_count;
+    int sector_cap;
+    portal *portals;
+    int portal_count;
+    int portal_cap;
+    unsigned char *pvs;
+    int pvs_stride;
+} sector_map;
+
+//The player's eye. The view matrix takes world space to view space, and
+//view_proj goes one step further to the clip space that clip_and_render and
+//setup work in. That's just view space with x and y scaled by the focal
+//length, so a clip space vertex's w is the same as its z. frustum holds the
+//view frustum's near, far, left, right, bottom and top planes in world space
+//as a*x + b*y + c*z + d, normalized and positive on the inside
+typedef struct camera {
+    float x;
+    float y;
+    float z;
+    float yaw;
+    matrix view;
+    matrix view_proj;
+    float frustum[6][4];
+} camera;
+
+//Inclusive pixel rectangle
+typedef struct rect {
+    int x0;
+    int y0;
+    int x1;
+    int y1;
+} rect;
+
+//Everything the rasterizers need to know about a triangle once it's been lit
+//and projected. A frame's worth of these is built up before any drawing is
+//done so they can be sorted into bins. pixel is what gets written to the
+//framebuffer, which is either the shaded color or the triangle's id.
+//Textured triangles carry u/w, v/w and 1/w as planes over the screen, each
+//as its change along x, its change along y and its value at the origin, and
+//are sampled from mip level mip at a light level out of 256. texels is the
+//level itself, or when lit is set a copy from the surface cache that already
+//has the light applied. textured is set when the rasterizers have to do that
+//themselves rather than leaving it to the visibility buffer. smooth is set
+//for Gouraud shaded triangles, which have their lit vertex colors as planes
+//in the same way. gouraud is set when the rasterizers have to step those
+//colors themselves, the same way textured is
+typedef struct tri_setup {
+    screen_point p[3];
+    rect bounds;
+    unsigned short near_z;
+    unsigned short far_z;
+    unsigned int pixel;
+    unsigned int shade;
+    unsigned char span_buffered;
+    unsigned char textured;
+    texture *tex;
+    int mip;
+    int light;
+    unsigned char lit;
+    unsigned int *texels;
+    float tex_plane[3][3];
+    unsigned char smooth;
+    unsigned char gouraud;
+    float color_plane[3][3];
+} tri_setup;
+
+//The parts of one bin's piece of a scanline already covered by static
+//scenery this frame, as sorted inclusive runs of pixels. Only valid while
+//epoch matches the frame's
+typedef struct span_list {
+    unsigned int epoch;
+    int count;
+    short x0[SPAN_LIST_MAX];
+    short x1[SPAN_LIST_MAX];
+} span_list;
+
+//Triangles waiting on setup, stored as structure-of-arrays so that each
+//field of a whole batch can be loaded as a vector. Vertices come already
+//projected to the screen, along with their clip space depth. nz is the z of
+//the face normal in clip space, which is all lighting needs
+typedef struct setup_batch {
+    float z[3][SETUP_BATCH];
+    int px[3][SETUP_BATCH];
+    int py[3][SETUP_BATCH];
+    int pz[3][SETUP_BATCH];
+    float u[3][SETUP_BATCH];
+    float v[3][SETUP_BATCH];
+    float vr[3][SETUP_BATCH];
+    float vg[3][SETUP_BATCH];
+    float vb[3][SETUP_BATCH];
+    float nz[SETUP_BATCH];
+    float r[SETUP_BATCH];
+    float g[SETUP_BATCH];
+    float b[SETUP_BATCH];
+    texture *tex[SETUP_BATCH];
+    int surface[SETUP_BATCH];
+    int count;
+} setup_batch;
+
+//What setup makes of a batch. Vertices come out in screen space, sorted by
+//ascending y, with order saying which of the batch's vertices each one was.
+//keep is nonzero for triangles that aren't entirely behind the camera
+typedef struct setup_result {
+    int x[3][SETUP_BATCH];
+    int y[3][SETUP_BATCH];
+    int z[3][SETUP_BATCH];
+    int order[3][SETUP_BATCH];
+    unsigned int pixel[SETUP_BATCH];
+    float light[SETUP_BATCH];
+    int keep[SETUP_BATCH];
+} setup_result;
+
+typedef void (*setup_func)(setup_batch *in, setup_result *out);
+
+//The setups overlapping one screen bin, in submission order. Chunks come
+//out of the frame arena and are chained as the bin fills
+typedef struct bin_chunk {
+    tri_setup *items[BIN_CHUNK];
+    int count;
+    struct bin_chunk *next;
+} bin_chunk;
+
+//A vector of integer attributes stepped in whole units along one axis, as in
+//a_note_on_interpolation.txt. Each attribute runs its own Bresenham: every
+//step it moves by the whole part of its slope, step, and by one more each
+//time its error, built up by rem, reaches den. That keeps it exactly on
+//from + k * (to - from) / den, rounded down, without a multiply or a float
+typedef struct interp {
+    int count;
+    int den;
+    int value[INTERP_MAX_ATTRS];
+    int step[INTERP_MAX_ATTRS];
+    int rem[INTERP_MAX_ATTRS];
+    int err[INTERP_MAX_ATTRS];
+} interp;
+
+//A triangle in the edge table of a bin's scanline sweep. It joins the active
+//edge table at its first row, is dropped after row end - 1, and switches its
+//short edge over at row mid. The edges are kept at the current row
+typedef struct active_tri {
+    tri_setup *rec;
+    rect area;
+    int order;
+    int end;
+    int mid;
+    interp long_edge;
+    interp short_edge;
+    struct active_tri *next;
+} active_tri;
+
+//pool has room for an active_tri for each of the bin's count setups. It's
+//only handed out when the edge table engine is in use
+typedef struct bin {
+    bin_chunk *first;
+    bin_chunk *last;
+    int count;
+    active_tri *pool;
+} bin;
+
+//A bump allocator. Memory is handed out of a chain of large blocks and only
+//ever given back all at once, either by arena_reset, which keeps the blocks
+//around to be reused, or by arena_free. Blocks are followed directly by the
+//memory they hand out
+typedef struct arena_block {
+    struct arena_block *next;
+    size_t size;
+    size_t used;
+} arena_block;
+
+typedef struct arena {
+    arena_block *first;
+    arena_block *current;
+    size_t block_size;
+} arena;
+
 #define list_for_each(l, i, n) for((i) = (l)->root, (n) = 0; (i) != NULL; (i) = (i)->next, (n)++)
 #define new(x) ((x*)malloc(sizeof(x)))
+#define arena_new(a, x) ((x*)arena_alloc((a), sizeof(x)))
+#define ARENA_ROUND(n) (((n) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+#define ARENA_DATA(b) ((char*)(b) + ARENA_ROUND(sizeof(arena_block)))
+
+//Meshes, colors and objects live as long as the scene does. Everything built
+//up while drawing a frame, setups and bins, only lives until the next one
+arena scene_arena;
+arena frame_arena;
+
+bin bins[BIN_COUNT];
+setup_batch pending;
+
+//Every texture made so far, by id
+texture *textures[MAX_TEXTURES];
+int texture_count = 0;
+
+//A lit copy of one mip level of an environment surface's texture. Entries
+//are found through a hash on surface and level, and kept in least recently
+//used order, most recent first. frame is the last frame they were used in
+typedef struct surface_entry {
+    int surface;
+    int mip;
+    int light;
+    int bytes;
+    unsigned int frame;
+    unsigned int *texels;
+    struct surface_entry *hash_next;
+    struct surface_entry *prev;
+    struct surface_entry *next;
+} surface_entry;
+
+surface_entry *surface_hash[SURFACE_HASH_SIZE];
+surface_entry *surface_lru_head = NULL, *surface_lru_tail = NULL;
+int surface_cache_bytes = 0, surface_count = 0;
+unsigned int surface_frame = 0;
+long surface_hits = 0, surface_misses = 0, surface_evictions = 0;
+
+//Triangles binned since the bins were last drawn
+int binned_count = 0;
+
+//Nothing set up gets drawn outside of this. It's narrowed to each portal a
+//sector is seen through
+rect scissor = {0, 0, SCREEN_WIDTH - 1, SCREEN_HEIGHT - 1};
+
+//Whether what's being set up is static scenery, which in the span buffer
+//mode has to be submitted front to back and ahead of anything else
+int static_geometry = 0;
+
+//The span buffer. Each bin keeps its own piece of every scanline's list so
+//that no two threads ever work on the same one
+span_list span_lists[SCREEN_HEIGHT][BINS_X];
+
+//Near goes first so that nothing behind the eye is left by the time the sides,
+//which all pass through it, get their turn
+clip_plane clip_planes[CLIP_PLANE_COUNT] = {
+    {OUT_NEAR, 0.0, 0.0, 1.0, -NEAR_Z},
+    {OUT_FAR, 0.0, 0.0, -1.0, SCREEN_DEPTH},
+    {GUARD_LEFT, 1.0, 0.0, GUARD_BAND * SCREEN_WIDTH / SCREEN_HEIGHT, 0.0},
+    {GUARD_RIGHT, -1.0, 0.0, GUARD_BAND * SCREEN_WIDTH / SCREEN_HEIGHT, 0.0},
+    {GUARD_BOTTOM, 0.0, 1.0, GUARD_BAND, 0.0},
+    {GUARD_TOP, 0.0, -1.0, GUARD_BAND, 0.0}
+};
+
+//Rasterizer thread pool. The main thread works on bins too, so there's one
+//fewer of these than there are threads drawing
+SDL_Thread *workers[MAX_WORKERS];
+int worker_count = 0;
+int workers_quit = 0;
+SDL_sem *work_start;
+SDL_sem *work_done;
+SDL_atomic_t next_bin;
 
 void clear_zbuf() {
     
@@ -84,6 +744,311 @@ int init_zbuf() {
     return 1;
 }
 
+//Fill the whole framebuffer with a single pixel value. Unlike the z-buffer
+//this can't be done with a memset since each pixel is four bytes wide
+void clear_fbuf(unsigned int pixel) {
+    
+    int i;
+    
+    for(i = 0; i < SCREEN_PIXELS; i++)
+        fbuf[i] = pixel;
+}
+
+int init_fbuf() {
+    
+    fbuf = (unsigned int*)malloc(SCREEN_PIXELS*4);
+    
+    if(!fbuf)
+        return 0;
+    
+    clear_fbuf(TO_PIXEL(0, 0, 0));
+    
+    return 1;
+}
+
+//Put a single tile back to the far plane and the clear color
+void clear_tile(int tile) {
+    
+    int x, y;
+    int addr = (tile / TILES_X) * BLOCK_SIZE * SCREEN_WIDTH + (tile % TILES_X) * BLOCK_SIZE;
+    
+    for(y = 0; y < BLOCK_SIZE; y++, addr += SCREEN_WIDTH) {
+        
+        memset((void*)&zbuf[addr], 255, BLOCK_SIZE*2);
+        
+        for(x = 0; x < BLOCK_SIZE; x++)
+            fbuf[addr + x] = clear_pixel;
+    }
+    
+    tile_clean[tile] = 1;
+    tile_zmin[tile] = 65535;
+    tile_zmax[tile] = 65535;
+}
+
+//Has to be called on a tile before anything in it is read or drawn during a
+//frame. The first touch of a frame clears whatever a previous frame left behind
+void touch_tile(int tile) {
+    
+    if(tile_epoch[tile] == frame_epoch)
+        return;
+    
+    if(!tile_clean[tile])
+        clear_tile(tile);
+        
+    tile_epoch[tile] = frame_epoch;
+    tile_clean[tile] = 0;
+}
+
+//Touch every tile covered by pixels x0 through x1 of a scanline
+void touch_span(int scanline, int x0, int x1) {
+    
+    int tile = (scanline / BLOCK_SIZE) * TILES_X;
+    int last = tile + x1 / BLOCK_SIZE;
+    
+    for(tile += x0 / BLOCK_SIZE; tile <= last; tile++)
+        touch_tile(tile);
+}
+
+//Check whether anything at depth z or farther would fail the depth test in
+//every one of the given tiles. Tiles not yet drawn this frame are at the far
+//plane and so never hide anything
+int hiz_tiles_hidden(int tx0, int ty0, int tx1, int ty1, unsigned short z) {
+    
+    int tx, ty, tile;
+    
+    for(ty = ty0; ty <= ty1; ty++) {
+        
+        for(tx = tx0, tile = ty * TILES_X + tx0; tx <= tx1; tx++, tile++) {
+            
+            if(tile_epoch[tile] != frame_epoch || tile_zmax[tile] > z)
+                return 0;
+        }
+    }
+    
+    return 1;
+}
+
+//Start a new frame. Rather than clearing the buffers, this just moves to a
+//new epoch so every tile reads as stale until it's touched again
+void begin_frame(unsigned int pixel) {
+    
+    int i;
+    
+    if(pixel != clear_pixel) {
+        
+        for(i = 0; i < TILE_COUNT; i++)
+            tile_clean[i] = 0;
+            
+        clear_pixel = pixel;
+    }
+    
+    vis_count = 0;
+    surface_frame++;
+    
+    //Epoch zero is reserved for tiles that have never been touched, so
+    //start everything over again if we ever wrap around
+    if(++frame_epoch == 0) {
+        
+        for(i = 0; i < TILE_COUNT; i++)
+            tile_epoch[i] = 0;
+            
+        for(i = 0; i < SCREEN_HEIGHT * BINS_X; i++)
+            span_lists[i / BINS_X][i % BINS_X].epoch = 0;
+            
+        frame_epoch = 1;
+    }
+}
+
+//Look up the lit texel a textured triangle puts at one pixel, dividing
+//through by 1/w right there
+unsigned int sample_texture(tri_setup *rec, int x, int y) {
+    
+    texture *tex = rec->tex;
+    int w_shift = tex->w_shift[rec->mip], h_shift = tex->h_shift[rec->mip];
+    float uw, vw, iw;
+    int u, v;
+    
+    uw = rec->tex_plane[0][0]*x + rec->tex_plane[0][1]*y + rec->tex_plane[0][2];
+    vw = rec->tex_plane[1][0]*x + rec->tex_plane[1][1]*y + rec->tex_plane[1][2];
+    iw = rec->tex_plane[2][0]*x + rec->tex_plane[2][1]*y + rec->tex_plane[2][2];
+    
+    if(iw <= 0)
+        return rec->shade;
+        
+    u = (int)floor(uw / iw * (1 << w_shift)) & ((1 << w_shift) - 1);
+    v = (int)floor(vw / iw * (1 << h_shift)) & ((1 << h_shift) - 1);
+    
+    if(rec->lit)
+        return rec->texels[TEX_BLOCK_INDEX(u, v, w_shift)];
+        
+    return TEX_MODULATE(rec->texels[TEX_BLOCK_INDEX(u, v, w_shift)], rec->light);
+}
+
+//Work out the color a Gouraud shaded triangle has at one pixel from the
+//planes fit to its vertex colors
+unsigned int sample_color(tri_setup *rec, int x, int y) {
+    
+    int c[3], i;
+    float f;
+    
+    for(i = 0; i < 3; i++) {
+        
+        f = rec->color_plane[i][0]*x + rec->color_plane[i][1]*y + rec->color_plane[i][2];
+        c[i] = (int)((f > 255 ? 255 : f < 0 ? 0 : f) + 0.5);
+    }
+    
+    return TO_PIXEL(c[0], c[1], c[2]);
+}
+
+//Shade every pixel of a tile holding a triangle id with that triangle's
+//color, its vertex colors, or its texture. Each visible pixel is shaded
+//exactly once, however many triangles were drawn over it
+void resolve_tile(int tile) {
+    
+    int x, y;
+    unsigned int v;
+    int addr = (tile / TILES_X) * BLOCK_SIZE * SCREEN_WIDTH + (tile % TILES_X) * BLOCK_SIZE;
+    
+    for(y = 0; y < BLOCK_SIZE; y++, addr += SCREEN_WIDTH) {
+        
+        for(x = 0; x < BLOCK_SIZE; x++) {
+            
+            v = fbuf[addr + x];
+            
+            if(v >= VIS_ID_LIMIT)
+                continue;
+                
+            if(vis_setups[v]->tex)
+                fbuf[addr + x] = sample_texture(vis_setups[v], (tile % TILES_X) * BLOCK_SIZE + x, (tile / TILES_X) * BLOCK_SIZE + y);
+            else if(vis_setups[v]->smooth)
+                fbuf[addr + x] = sample_color(vis_setups[v], (tile % TILES_X) * BLOCK_SIZE + x, (tile / TILES_X) * BLOCK_SIZE + y);
+            else
+                fbuf[addr + x] = vis_setups[v]->shade;
+        }
+    }
+}
+
+//Tiles that weren't drawn this frame may still hold pixels from an earlier
+//one, so get those back to the clear color before the frame goes out. Tiles
+//that were already clean cost nothing. If anything went through the
+//visibility buffer, the tiles that were drawn get shaded now
+void finish_frame() {
+    
+    int i;
+    
+    for(i = 0; i < TILE_COUNT; i++) {
+        
+        if(tile_epoch[i] != frame_epoch) {
+            
+            if(!tile_clean[i])
+                clear_tile(i);
+        } else if(vis_count) {
+            
+            resolve_tile(i);
+        }
+    }
+}
+
+void init_arena(arena *a, size_t block_size) {
+    
+    a->first = a->current = NULL;
+    a->block_size = block_size;
+}
+
+void *arena_alloc(arena *a, size_t size) {
+    
+    arena_block *block = a->current, *fresh;
+    size_t fresh_size;
+    void *ret;
+    
+    size = ARENA_ROUND(size);
+    
+    //Move on down the chain, reusing blocks left over from before a reset,
+    //until one has room
+    if(block && block->used + size > block->size) {
+        
+        while(block->next) {
+            
+            block = block->next;
+            block->used = 0;
+            a->current = block;
+            
+            if(size <= block->size)
+                break;
+        }
+    }
+    
+    if(!block || block->used + size > block->size) {
+        
+        fresh_size = size > a->block_size ? size : a->block_size;
+        
+        if(!(fresh = (arena_block*)malloc(ARENA_ROUND(sizeof(arena_block)) + fresh_size)))
+            return NULL;
+            
+        fresh->size = fresh_size;
+        fresh->used = 0;
+        fresh->next = NULL;
+        
+        if(block)
+            block->next = fresh;
+        else
+            a->first = fresh;
+            
+        a->current = block = fresh;
+    }
+    
+    ret = (void*)(ARENA_DATA(block) + block->used);
+    block->used += size;
+    
+    return ret;
+}
+
+//Arena memory can't be resized, so a growing array gets a fresh copy. The
+//exception is when it was the last thing allocated and there's room to just
+//extend it where it is
+void *arena_grow(arena *a, void *old, size_t old_size, size_t new_size) {
+    
+    arena_block *block = a->current;
+    void *ret;
+    
+    if(old && block && (char*)old + ARENA_ROUND(old_size) == ARENA_DATA(block) + block->used &&
+       block->used - ARENA_ROUND(old_size) + ARENA_ROUND(new_size) <= block->size) {
+        
+        block->used = block->used - ARENA_ROUND(old_size) + ARENA_ROUND(new_size);
+        return old;
+    }
+    
+    if(!(ret = arena_alloc(a, new_size)))
+        return NULL;
+        
+    if(old)
+        memcpy(ret, old, old_size);
+        
+    return ret;
+}
+
+//Release everything allocated from the arena in one go, keeping its blocks
+void arena_reset(arena *a) {
+    
+    a->current = a->first;
+    
+    if(a->first)
+        a->first->used = 0;
+}
+
+void arena_free(arena *a) {
+    
+    arena_block *block, *next;
+    
+    for(block = a->first; block; block = next) {
+        
+        next = block->next;
+        free(block);
+    }
+    
+    a->first = a->current = NULL;
+}
+
 void clone_color(color* src, color* dst) {
     
     dst->r = src->r;
@@ -145,7 +1110,7 @@ void dump_list(list *target) {
 
 color *new_color(unsigned char r, unsigned char g, unsigned char b, unsigned char a) {
     
-    color *ret_color = new(color);
+    color *ret_color = arena_new(&scene_arena, color);
     
     if(!ret_color)
         return ret_color;
@@ -158,22 +1123,243 @@ color *new_color(unsigned char r, unsigned char g, unsigned char b, unsigned cha
     return ret_color;
 }
 
-void clone_vertex(vertex *src, vertex* dst) {
+//Make a texture out of a 1 << w_shift by 1 << h_shift image of ARGB8888
+//pixels in rows, building its mip levels by averaging each 2x2 square of the
+//level above. Both sides have to be at least a block wide. The texture goes
+//in the scene arena. Returns NULL on failure
+texture *new_texture(int w_shift, int h_shift, unsigned int *pixels) {
     
-    dst->x = src->x;
-    dst->y = src->y;
-    dst->z = src->z;
-    dst->c = src->c;
+    texture *tex;
+    unsigned int *linear, *src, t[4];
+    int level, w, h, x, y, i, c, sum;
+    
+    if(texture_count == MAX_TEXTURES || w_shift < TEX_BLOCK_SHIFT || h_shift < TEX_BLOCK_SHIFT)
+        return NULL;
+        
+    if(!(tex = arena_new(&scene_arena, texture)))
+        return NULL;
+        
+    //Each level is built in rows first, and that's what the next one is
+    //filtered down from
+    if(!(linear = (unsigned int*)malloc((sizeof(unsigned int) << w_shift) << h_shift)))
+        return NULL;
+        
+    memcpy(linear, pixels, (sizeof(unsigned int) << w_shift) << h_shift);
+    
+    for(level = 0; level < TEX_MAX_LEVELS; level++) {
+        
+        w = 1 << w_shift;
+        h = 1 << h_shift;
+        tex->w_shift[level] = w_shift;
+        tex->h_shift[level] = h_shift;
+        
+        if(!(tex->texels[level] = (unsigned int*)arena_alloc(&scene_arena, w * h * sizeof(unsigned int)))) {
+            
+            free(linear);
+            return NULL;
+        }
+        
+        for(y = 0; y < h; y++)
+            for(x = 0; x < w; x++)
+                tex->texels[level][TEX_BLOCK_INDEX(x, y, w_shift)] = linear[y * w + x];
+                
+        tex->levels = level + 1;
+        
+        if(w_shift == TEX_BLOCK_SHIFT || h_shift == TEX_BLOCK_SHIFT)
+            break;
+            
+        //Filtering in place works since each texel of the next level is
+        //written after the ones it's made from have been read
+        for(y = 0, src = linear; y < h / 2; y++) {
+            
+            for(x = 0; x < w / 2; x++) {
+                
+                t[0] = src[2*y*w + 2*x];
+                t[1] = src[2*y*w + 2*x + 1];
+                t[2] = src[(2*y + 1)*w + 2*x];
+                t[3] = src[(2*y + 1)*w + 2*x + 1];
+                linear[y * (w / 2) + x] = 0;
+                
+                for(c = 0; c < 32; c += 8) {
+                    
+                    for(i = 0, sum = 0; i < 4; i++)
+                        sum += (t[i] >> c) & 0xFF;
+                        
+                    linear[y * (w / 2) + x] |= (unsigned int)((sum + 2) / 4) << c;
+                }
+            }
+        }
+        
+        w_shift--;
+        h_shift--;
+    }
+    
+    free(linear);
+    tex->id = texture_count;
+    textures[texture_count++] = tex;
+    
+    return tex;
 }
 
-triangle *new_triangle(vertex *v1, vertex *v2, vertex *v3) {
+//A square texture of two colors in checks of 8 texels
+texture *new_checker_texture(int shift, unsigned int a, unsigned int b) {
     
-    triangle *ret_tri = new(triangle);
+    unsigned int *pixels;
+    texture *tex;
+    int x, y;
     
-    if(!ret_tri)
-        return ret_tri;
+    if(!(pixels = (unsigned int*)malloc((sizeof(unsigned int) << shift) << shift)))
+        return NULL;
         
-    clone_vertex(v1, &(ret_tri->v[0]));
+    for(y = 0; y < 1 << shift; y++)
+        for(x = 0; x < 1 << shift; x++)
+            pixels[(y << shift) + x] = ((x >> 3) ^ (y >> 3)) & 1 ? b : a;
+            
+    tex = new_texture(shift, shift, pixels);
+    free(pixels);
+    
+    return tex;
+}
+
+//Take an entry out of the recently used list
+void unlink_surface(surface_entry *e) {
+    
+    if(e->prev)
+        e->prev->next = e->next;
+    else
+        surface_lru_head = e->next;
+        
+    if(e->next)
+        e->next->prev = e->prev;
+    else
+        surface_lru_tail = e->prev;
+}
+
+//Throw an entry out of the cache altogether
+void drop_surface(surface_entry *e) {
+    
+    surface_entry **link = &surface_hash[(e->surface * TEX_MAX_LEVELS + e->mip) & (SURFACE_HASH_SIZE - 1)];
+    
+    while(*link != e)
+        link = &((*link)->hash_next);
+        
+    *link = e->hash_next;
+    unlink_surface(e);
+    surface_cache_bytes -= e->bytes;
+    free(e->texels);
+    free(e);
+}
+
+//Find the lit copy of mip level mip of an environment surface's texture,
+//building it at a light level out of 256 if it isn't there. A surface keeps
+//the light it was first used at for the rest of the frame, and the entries
+//used this frame are never evicted since setups already point at them.
+//Returns NULL if there's no room without one of those or the memory ran out
+surface_entry *cache_surface(int surface, texture *tex, int mip, int light) {
+    
+    int i, bytes, index = (surface * TEX_MAX_LEVELS + mip) & (SURFACE_HASH_SIZE - 1);
+    surface_entry *e;
+    
+    for(e = surface_hash[index]; e && (e->surface != surface || e->mip != mip); e = e->hash_next);
+    
+    if(e && (e->light == light || e->frame == surface_frame)) {
+        
+        surface_hits++;
+        unlink_surface(e);
+    } else {
+        
+        surface_misses++;
+        
+        if(e) {
+            
+            unlink_surface(e);
+        } else {
+            
+            bytes = (sizeof(unsigned int) << tex->w_shift[mip]) << tex->h_shift[mip];
+            
+            //The least recently used entry is at the tail, so once that was
+            //used this frame they all were
+            while(surface_cache_bytes + bytes > SURFACE_CACHE_BYTES && surface_lru_tail && surface_lru_tail->frame != surface_frame) {
+                
+                drop_surface(surface_lru_tail);
+                surface_evictions++;
+            }
+            
+            if(surface_cache_bytes + bytes > SURFACE_CACHE_BYTES || !(e = new(surface_entry)))
+                return NULL;
+                
+            if(!(e->texels = (unsigned int*)malloc(bytes))) {
+                
+                free(e);
+                return NULL;
+            }
+            
+            e->surface = surface;
+            e->mip = mip;
+            e->bytes = bytes;
+            e->hash_next = surface_hash[index];
+            surface_hash[index] = e;
+            surface_cache_bytes += bytes;
+        }
+        
+        //The copy keeps the level's block layout, so it's sampled exactly
+        //the same way
+        for(i = 0; i < e->bytes / (int)sizeof(unsigned int); i++)
+            e->texels[i] = TEX_MODULATE(tex->texels[mip][i], light);
+            
+        e->light = light;
+    }
+    
+    e->prev = NULL;
+    e->next = surface_lru_head;
+    
+    if(surface_lru_head)
+        surface_lru_head->prev = e;
+    else
+        surface_lru_tail = e;
+        
+    surface_lru_head = e;
+    e->frame = surface_frame;
+    
+    return e;
+}
+
+void print_surface_cache() {
+    
+    printf("Surface cache: %ld hits, %ld misses, %ld evictions, %d KB in use\n",
+           surface_hits, surface_misses, surface_evictions, surface_cache_bytes / 1024);
+}
+
+void free_surface_cache() {
+    
+    while(surface_lru_head)
+        drop_surface(surface_lru_head);
+}
+
+void clone_vertex(vertex *src, vertex* dst) {
+    
+    dst->x = src->x;
+    dst->y = src->y;
+    dst->z = src->z;
+    dst->u = src->u;
+    dst->v = src->v;
+    dst->nx = src->nx;
+    dst->ny = src->ny;
+    dst->nz = src->nz;
+    dst->r = src->r;
+    dst->g = src->g;
+    dst->b = src->b;
+    dst->c = src->c;
+}
+
+triangle *new_triangle(vertex *v1, vertex *v2, vertex *v3) {
+    
+    triangle *ret_tri = new(triangle);
+    
+    if(!ret_tri)
+        return ret_tri;
+        
+    clone_vertex(v1, &(ret_tri->v[0]));
     clone_vertex(v2, &(ret_tri->v[1]));
     clone_vertex(v3, &(ret_tri->v[2]));    
     
@@ -191,39 +1377,323 @@ void purge_list(list *target) {
     }
 }
 
-void delete_object(object *obj) {
+void matrix_identity(matrix *out) {
     
-    node *item;
-    int i;
+    int i, j;
     
-    list_for_each(&(obj->tri_list), item, i) {
-        
-        free(item->payload);
-    }
+    for(i = 0; i < 4; i++)
+        for(j = 0; j < 4; j++)
+            out->m[i][j] = i == j ? 1.0 : 0.0;
+}
+
+//out = a * b. out may be the same as either input
+void matrix_multiply(matrix *a, matrix *b, matrix *out) {
+    
+    int i, j;
+    matrix result;
+    
+    for(i = 0; i < 4; i++)
+        for(j = 0; j < 4; j++)
+            result.m[i][j] = a->m[i][0]*b->m[0][j] + a->m[i][1]*b->m[1][j] + 
+                             a->m[i][2]*b->m[2][j] + a->m[i][3]*b->m[3][j];
+                             
+    *out = result;
+}
+
+void matrix_translation(matrix *out, float x, float y, float z) {
+    
+    matrix_identity(out);
+    out->m[0][3] = x;
+    out->m[1][3] = y;
+    out->m[2][3] = z;
+}
+
+//Rotations by an angle in degrees about each of the axes
+void matrix_rotation_x(matrix *out, float angle) {
+    
+    float c = cos(DEG_TO_RAD(angle)), s = sin(DEG_TO_RAD(angle));
+    
+    matrix_identity(out);
+    out->m[1][1] = c;
+    out->m[1][2] = -s;
+    out->m[2][1] = s;
+    out->m[2][2] = c;
+}
+
+void matrix_rotation_y(matrix *out, float angle) {
+    
+    float c = cos(DEG_TO_RAD(angle)), s = sin(DEG_TO_RAD(angle));
+    
+    matrix_identity(out);
+    out->m[0][0] = c;
+    out->m[0][2] = s;
+    out->m[2][0] = -s;
+    out->m[2][2] = c;
+}
+
+void matrix_rotation_z(matrix *out, float angle) {
+    
+    float c = cos(DEG_TO_RAD(angle)), s = sin(DEG_TO_RAD(angle));
+    
+    matrix_identity(out);
+    out->m[0][0] = c;
+    out->m[0][1] = -s;
+    out->m[1][0] = s;
+    out->m[1][1] = c;
+}
+
+//Turn a normal by a transform's rotation without moving it. Going into clip
+//space scales its x and y by the focal length, but z comes out as it would
+//in view space, and that's all lighting looks at
+void transform_normal(matrix *m, float x, float y, float z, float *nx, float *ny, float *nz) {
+    
+    *nx = m->m[0][0]*x + m->m[0][1]*y + m->m[0][2]*z;
+    *ny = m->m[1][0]*x + m->m[1][1]*y + m->m[1][2]*z;
+    *nz = m->m[2][0]*x + m->m[2][1]*y + m->m[2][2]*z;
+}
+
+//Transform a point by an affine matrix. The color and texture coordinates
+//ride along untouched
+void transform_vertex(matrix *m, vertex *src, vertex *dst) {
+    
+    dst->x = m->m[0][0]*src->x + m->m[0][1]*src->y + m->m[0][2]*src->z + m->m[0][3];
+    dst->y = m->m[1][0]*src->x + m->m[1][1]*src->y + m->m[1][2]*src->z + m->m[1][3];
+    dst->z = m->m[2][0]*src->x + m->m[2][1]*src->y + m->m[2][2]*src->z + m->m[2][3];
+    dst->u = src->u;
+    dst->v = src->v;
+    dst->r = src->r;
+    dst->g = src->g;
+    dst->b = src->b;
+    dst->c = src->c;
     
-    purge_list(&(obj->tri_list));
-    free(obj);
+    transform_normal(m, src->nx, src->ny, src->nz, &(dst->nx), &(dst->ny), &(dst->nz));
 }
 
 object *new_object() {
     
-    object *ret_obj = new(object);
+    object *ret_obj = arena_new(&scene_arena, object);
     
     if(!ret_obj)
         return ret_obj;
         
-    ret_obj->tri_list.root = NULL;
+    ret_obj->tex = NULL;
+    ret_obj->faces = NULL;
+    ret_obj->face_count = ret_obj->face_cap = 0;
+    ret_obj->verts = NULL;
+    ret_obj->xform = NULL;
+    ret_obj->vert_count = ret_obj->vert_cap = 0;
+    ret_obj->xform_stamp = 0;
     ret_obj->x = ret_obj->y = ret_obj->z = 0.0;
+    matrix_identity(&(ret_obj->model));
     
     return ret_obj;
 }
 
+//Append a vertex to an object's mesh and return its index, or -1 on failure
+int add_vertex(object *obj, float x, float y, float z, color *c) {
+    
+    vertex *grown_verts;
+    xvertex *grown_xform;
+    int new_cap;
+    
+    if(obj->vert_count == obj->vert_cap) {
+        
+        new_cap = obj->vert_cap ? obj->vert_cap * 2 : 16;
+        
+        if(!(grown_verts = (vertex*)arena_grow(&scene_arena, obj->verts, obj->vert_cap * sizeof(vertex), new_cap * sizeof(vertex))))
+            return -1;
+            
+        obj->verts = grown_verts;
+        
+        if(!(grown_xform = (xvertex*)arena_grow(&scene_arena, obj->xform, obj->vert_cap * sizeof(xvertex), new_cap * sizeof(xvertex))))
+            return -1;
+            
+        obj->xform = grown_xform;
+        obj->vert_cap = new_cap;
+    }
+    
+    obj->verts[obj->vert_count].x = x;
+    obj->verts[obj->vert_count].y = y;
+    obj->verts[obj->vert_count].z = z;
+    obj->verts[obj->vert_count].u = 0;
+    obj->verts[obj->vert_count].v = 0;
+    obj->verts[obj->vert_count].nx = obj->verts[obj->vert_count].ny = obj->verts[obj->vert_count].nz = 0;
+    obj->verts[obj->vert_count].r = obj->verts[obj->vert_count].g = obj->verts[obj->vert_count].b = 0;
+    obj->verts[obj->vert_count].c = c;
+    obj->xform[obj->vert_count].stamp = 0;
+    
+    return obj->vert_count++;
+}
+
+//Append a face to an object's mesh and return its index, or -1 on failure
+int add_face(object *obj, int v1, int v2, int v3) {
+    
+    face *grown;
+    int new_cap;
+    
+    if(obj->face_count == obj->face_cap) {
+        
+        new_cap = obj->face_cap ? obj->face_cap * 2 : 16;
+        
+        if(!(grown = (face*)arena_grow(&scene_arena, obj->faces, obj->face_cap * sizeof(face), new_cap * sizeof(face))))
+            return -1;
+            
+        obj->faces = grown;
+        obj->face_cap = new_cap;
+    }
+    
+    obj->faces[obj->face_count].v[0] = v1;
+    obj->faces[obj->face_count].v[1] = v2;
+    obj->faces[obj->face_count].v[2] = v3;
+    memset(obj->faces[obj->face_count].uv, 0, sizeof(obj->faces[obj->face_count].uv));
+    obj->faces[obj->face_count].nx = obj->faces[obj->face_count].ny = obj->faces[obj->face_count].nz = 0;
+    
+    return obj->face_count++;
+}
+
+//Give each corner of a face its texture coordinates
+void set_face_uv(object *obj, int index, float (*uv)[2]) {
+    
+    memcpy(obj->faces[index].uv, uv, sizeof(obj->faces[index].uv));
+}
+
+//Give every face of a mesh its unit normal, and every vertex the average of
+//the normals of the faces around it, each weighted by the face's area. Has
+//to be done again whenever the mesh changes shape. Faces without any area
+//are left with a zero normal, which has them culled as facing away
+void compute_normals(object *obj) {
+    
+    int i, j;
+    vertex *v[3];
+    face *f;
+    float ax, ay, az, bx, by, bz, cx, cy, cz, mag;
+    
+    for(i = 0; i < obj->vert_count; i++)
+        obj->verts[i].nx = obj->verts[i].ny = obj->verts[i].nz = 0;
+        
+    //The cross product's length is twice the face's area, so summing them
+    //unnormalized does the weighting
+    for(i = 0; i < obj->face_count; i++) {
+        
+        f = &(obj->faces[i]);
+        
+        for(j = 0; j < 3; j++)
+            v[j] = &(obj->verts[f->v[j]]);
+            
+        ax = v[0]->x - v[2]->x;
+        ay = v[0]->y - v[2]->y;
+        az = v[0]->z - v[2]->z;
+        bx = v[1]->x - v[2]->x;
+        by = v[1]->y - v[2]->y;
+        bz = v[1]->z - v[2]->z;
+        cx = ay*bz - az*by;
+        cy = az*bx - ax*bz;
+        cz = ax*by - ay*bx;
+        
+        for(j = 0; j < 3; j++) {
+            
+            v[j]->nx += cx;
+            v[j]->ny += cy;
+            v[j]->nz += cz;
+        }
+        
+        mag = sqrt(cx*cx + cy*cy + cz*cz);
+        f->nx = mag > 0 ? cx / mag : 0;
+        f->ny = mag > 0 ? cy / mag : 0;
+        f->nz = mag > 0 ? cz / mag : 0;
+    }
+    
+    for(i = 0; i < obj->vert_count; i++) {
+        
+        mag = sqrt(obj->verts[i].nx*obj->verts[i].nx + obj->verts[i].ny*obj->verts[i].ny + obj->verts[i].nz*obj->verts[i].nz);
+        
+        if(mag > 0) {
+            
+            obj->verts[i].nx /= mag;
+            obj->verts[i].ny /= mag;
+            obj->verts[i].nz /= mag;
+        }
+    }
+}
+
+//Carry the object space bounds through the model matrix. The box stays
+//axis-aligned by growing to fit its rotated self
+void update_world_bounds(object *obj) {
+    
+    int i;
+    float c[3], e[3], center, extent, scale, len;
+    matrix *m = &(obj->model);
+    
+    for(i = 0; i < 3; i++) {
+        
+        c[i] = (obj->bounds.min[i] + obj->bounds.max[i]) / 2.0;
+        e[i] = (obj->bounds.max[i] - obj->bounds.min[i]) / 2.0;
+    }
+    
+    scale = 0;
+    
+    for(i = 0; i < 3; i++) {
+        
+        center = m->m[i][0]*c[0] + m->m[i][1]*c[1] + m->m[i][2]*c[2] + m->m[i][3];
+        extent = fabs(m->m[i][0])*e[0] + fabs(m->m[i][1])*e[1] + fabs(m->m[i][2])*e[2];
+        obj->world_bounds.min[i] = center - extent;
+        obj->world_bounds.max[i] = center + extent;
+        
+        obj->world_sphere.c[i] = m->m[i][0]*obj->bound_sphere.c[0] + m->m[i][1]*obj->bound_sphere.c[1] + 
+                                 m->m[i][2]*obj->bound_sphere.c[2] + m->m[i][3];
+        
+        //The sphere grows by the most any axis gets stretched
+        len = m->m[0][i]*m->m[0][i] + m->m[1][i]*m->m[1][i] + m->m[2][i]*m->m[2][i];
+        scale = len > scale ? len : scale;
+    }
+    
+    obj->world_sphere.r = obj->bound_sphere.r * sqrt(scale);
+}
+
+//Fit a box and a sphere around an object's mesh once it's been built
+void compute_bounds(object *obj) {
+    
+    int i, j;
+    float d, r2 = 0;
+    
+    for(j = 0; j < 3; j++)
+        obj->bounds.min[j] = obj->bounds.max[j] = 0;
+    
+    for(i = 0; i < obj->vert_count; i++) {
+        
+        for(j = 0; j < 3; j++) {
+            
+            d = j == 0 ? obj->verts[i].x : j == 1 ? obj->verts[i].y : obj->verts[i].z;
+            
+            if(i == 0 || d < obj->bounds.min[j])
+                obj->bounds.min[j] = d;
+                
+            if(i == 0 || d > obj->bounds.max[j])
+                obj->bounds.max[j] = d;
+        }
+    }
+    
+    //The box's center is not the tightest sphere center but is close
+    for(j = 0; j < 3; j++)
+        obj->bound_sphere.c[j] = (obj->bounds.min[j] + obj->bounds.max[j]) / 2.0;
+        
+    for(i = 0; i < obj->vert_count; i++) {
+        
+        d = (obj->verts[i].x - obj->bound_sphere.c[0]) * (obj->verts[i].x - obj->bound_sphere.c[0]) +
+            (obj->verts[i].y - obj->bound_sphere.c[1]) * (obj->verts[i].y - obj->bound_sphere.c[1]) +
+            (obj->verts[i].z - obj->bound_sphere.c[2]) * (obj->verts[i].z - obj->bound_sphere.c[2]);
+        r2 = d > r2 ? d : r2;
+    }
+    
+    obj->bound_sphere.r = sqrt(r2);
+    update_world_bounds(obj);
+}
+
 object *new_cube(float s, color *c) {
     
     object* ret_obj = new_object();
-    int i;
-        triangle *temp_tri;
-    vertex temp_v[3];
+    int i, j, axis;
+    float uv[3][2];
     float half_s = s/2.0;
     float points[][3] = {
         {-half_s, half_s, -half_s},
@@ -261,983 +1731,3973 @@ object *new_cube(float s, color *c) {
     if(!ret_obj)
         return ret_obj;
     
-    temp_v[0].c = c;
-    temp_v[1].c = c;
-    temp_v[2].c = c;
+    //The corners are shared by the faces that meet at them, so the indices
+    //in order line up with the vertex indices
+    for(i = 0; i < 8; i++) {
+        
+        if(add_vertex(ret_obj, points[i][0], points[i][1], points[i][2], c) < 0) {
+            
+            //Whatever did get allocated goes when the scene arena does
+            printf("[new_cube] failed to allocate vertex #%d\n", i+1);
+            return NULL;
+        }
+    }
     
     for(i = 0; i < 12; i++) {
-     
-        temp_v[0].x = points[order[i][0]][0];
-        temp_v[0].y = points[order[i][0]][1];
-        temp_v[0].z = points[order[i][0]][2];
-        temp_v[1].x = points[order[i][1]][0];
-        temp_v[1].y = points[order[i][1]][1];
-        temp_v[1].z = points[order[i][1]][2];
-        temp_v[2].x = points[order[i][2]][0];
-        temp_v[2].y = points[order[i][2]][1];
-        temp_v[2].z = points[order[i][2]][2];
-        
-        printf("[new_cube] Creating new triangle (%f, %f, %f), (%f, %f, %f), (%f, %f, %f)\n", temp_v[0].x, temp_v[0].y, temp_v[0].z, temp_v[1].x, temp_v[1].y, temp_v[1].z,  temp_v[2].x, temp_v[2].y, temp_v[2].z);
-        
-        if(!(temp_tri = new_triangle(&temp_v[0], &temp_v[1], &temp_v[2]))) {
-            
-            printf("[new_cube] failed to allocate triangle #%d\n", i+1);
-            delete_object(ret_obj);
+        
+        printf("[new_cube] Creating new face (%d, %d, %d)\n", order[i][0], order[i][1], order[i][2]);
+        
+        if(add_face(ret_obj, order[i][0], order[i][1], order[i][2]) < 0) {
+            
+            printf("[new_cube] failed to allocate face #%d\n", i+1);
             return NULL;        
         }
-        printf("[new_cube] generated triangle #%d\n", i+1);
         
-        list_push(&(ret_obj->tri_list), (void*)temp_tri);
-        printf("[new_cube] inserted triangle #%d\n", i+1);
+        //Every side of the cube gets the whole texture once, mapped along
+        //the two axes the side lies across
+        axis = points[order[i][0]][0] == points[order[i][1]][0] && points[order[i][0]][0] == points[order[i][2]][0] ? 0 :
+               points[order[i][0]][1] == points[order[i][1]][1] && points[order[i][0]][1] == points[order[i][2]][1] ? 1 : 2;
+        
+        for(j = 0; j < 3; j++) {
+            
+            uv[j][0] = (points[order[i][j]][axis == 0 ? 2 : 0] + half_s) / s;
+            uv[j][1] = (half_s - points[order[i][j]][axis == 1 ? 2 : 1]) / s;
+        }
+        
+        set_face_uv(ret_obj, i, uv);
+        printf("[new_cube] inserted face #%d\n", i+1);
     }
     
+    compute_normals(ret_obj);
+    compute_bounds(ret_obj);
+    
     return ret_obj;
 }
 
 void translate_object(object* obj, float x, float y, float z) {
     
-    triangle *temp_tri;
-    node     *item;
-    int      i, j;
+    matrix t;
     
     obj->x += x;
     obj->y += y;
     obj->z += z;
     
-    list_for_each(&(obj->tri_list), item, i) {
-        
-        temp_tri = (triangle*)(item->payload);
-        
-        for(j = 0; j < 3; j++) {
-        
-            temp_tri->v[j].x += x;
-            temp_tri->v[j].y += y;
-            temp_tri->v[j].z += z;
-        }
-    }
+    matrix_translation(&t, x, y, z);
+    matrix_multiply(&t, &(obj->model), &(obj->model));
+    update_world_bounds(obj);
+}
+
+//Rotating about the world origin carries the object's position around too
+void rotate_object_global(object* obj, matrix *r) {
+    
+    matrix_multiply(r, &(obj->model), &(obj->model));
+    obj->x = obj->model.m[0][3];
+    obj->y = obj->model.m[1][3];
+    obj->z = obj->model.m[2][3];
+    update_world_bounds(obj);
 }
 
 void rotate_object_x_global(object* obj, float angle) {
     
-    float rad_angle = DEG_TO_RAD(angle);
-    triangle *temp_tri;
-    node     *item;
-    int      i, j;
-    float temp_y, temp_z;
-        
-    list_for_each(&(obj->tri_list), item, i) {
-        
-        temp_tri = (triangle*)(item->payload);
+    matrix r;
+    
+    matrix_rotation_x(&r, angle);
+    rotate_object_global(obj, &r);
+}
+
+void rotate_object_y_global(object* obj, float angle) {
+    
+    matrix r;
+    
+    matrix_rotation_y(&r, angle);
+    rotate_object_global(obj, &r);
+}
+
+void rotate_object_z_global(object* obj, float angle) {
+    
+    matrix r;
+    
+    matrix_rotation_z(&r, angle);
+    rotate_object_global(obj, &r);
+}
+
+//Rotate in place about the object's own position, which stays put
+void rotate_object_local(object* obj, matrix *r) {
+    
+    matrix t;
+    
+    matrix_translation(&t, -obj->x, -obj->y, -obj->z);
+    matrix_multiply(&t, &(obj->model), &(obj->model));
+    matrix_multiply(r, &(obj->model), &(obj->model));
+    matrix_translation(&t, obj->x, obj->y, obj->z);
+    matrix_multiply(&t, &(obj->model), &(obj->model));
+    update_world_bounds(obj);
+}
+
+void rotate_object_x_local(object* obj, float angle) {
+    
+    matrix r;
+    
+    matrix_rotation_x(&r, angle);
+    rotate_object_local(obj, &r);
+}
+
+void rotate_object_y_local(object* obj, float angle) {
+    
+    matrix r;
+    
+    matrix_rotation_y(&r, angle);
+    rotate_object_local(obj, &r);
+}
+
+void rotate_object_z_local(object* obj, float angle) {
+    
+    matrix r;
+    
+    matrix_rotation_z(&r, angle);
+    rotate_object_local(obj, &r);
+}
+
+//Rebuild the camera's matrices after it's been moved or turned
+void update_camera(camera *cam) {
+    
+    int i, j;
+    matrix t;
+    float aspect = (float)SCREEN_WIDTH / SCREEN_HEIGHT;
+    float sx = 1.0 / sqrt(focal_length*focal_length + aspect*aspect);
+    float sy = 1.0 / sqrt(focal_length*focal_length + 1.0);
+    float planes[6][4] = {
+        {0.0, 0.0, 1.0, -NEAR_Z},
+        {0.0, 0.0, -1.0, SCREEN_DEPTH},
+        {focal_length*sx, 0.0, aspect*sx, 0.0},
+        {-focal_length*sx, 0.0, aspect*sx, 0.0},
+        {0.0, focal_length*sy, sy, 0.0},
+        {0.0, -focal_length*sy, sy, 0.0}
+    };
+    
+    matrix_translation(&t, -cam->x, -cam->y, -cam->z);
+    matrix_rotation_y(&(cam->view), -cam->yaw);
+    matrix_multiply(&(cam->view), &t, &(cam->view));
+    
+    //Fold the focal length scaling of the projection in on top
+    cam->view_proj = cam->view;
+    
+    for(i = 0; i < 4; i++) {
         
-        for(j = 0; j < 3; j++) {
+        cam->view_proj.m[0][i] *= focal_length;
+        cam->view_proj.m[1][i] *= focal_length;
+    }
+    
+    //The frustum planes are simple in view space, and taking them back to
+    //world space is just a matter of running them through the view matrix
+    for(i = 0; i < 6; i++)
+        for(j = 0; j < 4; j++)
+            cam->frustum[i][j] = planes[i][0]*cam->view.m[0][j] + planes[i][1]*cam->view.m[1][j] +
+                                 planes[i][2]*cam->view.m[2][j] + (j == 3 ? planes[i][3] : 0.0);
+}
+
+int sphere_in_frustum(camera *cam, sphere *s) {
+    
+    int i, ret = FRUSTUM_INSIDE;
+    float d;
+    
+    for(i = 0; i < 6; i++) {
         
-            temp_y = temp_tri->v[j].y;
-            temp_z = temp_tri->v[j].z;
+        d = cam->frustum[i][0]*s->c[0] + cam->frustum[i][1]*s->c[1] + cam->frustum[i][2]*s->c[2] + cam->frustum[i][3];
         
-            temp_tri->v[j].y = (temp_y * cos(rad_angle)) - (temp_z * sin(rad_angle));
-            temp_tri->v[j].z = (temp_y * sin(rad_angle)) + (temp_z * cos(rad_angle));
-        }
+        if(d < -s->r)
+            return FRUSTUM_OUTSIDE;
+            
+        if(d < s->r)
+            ret = FRUSTUM_PARTIAL;
     }
+    
+    return ret;
 }
 
-void rotate_object_y_global(object* obj, float angle) {
+//For each plane, the box's corner farthest along the plane's normal decides
+//whether any of it is inside and the nearest whether all of it is
+int box_in_frustum(camera *cam, box *b) {
     
-    float rad_angle = DEG_TO_RAD(angle);
-    triangle *temp_tri;
-    node     *item;
-    int      i, j;
-    float temp_x, temp_z;
-        
-    list_for_each(&(obj->tri_list), item, i) {
+    int i, j, ret = FRUSTUM_INSIDE;
+    float far_d, near_d;
+    
+    for(i = 0; i < 6; i++) {
         
-        temp_tri = (triangle*)(item->payload);
+        far_d = near_d = cam->frustum[i][3];
         
         for(j = 0; j < 3; j++) {
             
-            temp_x = temp_tri->v[j].x;
-            temp_z = temp_tri->v[j].z;
-            
-            temp_tri->v[j].x = (temp_x * cos(rad_angle)) + (temp_z * sin(rad_angle));
-            temp_tri->v[j].z = (temp_z * cos(rad_angle)) - (temp_x * sin(rad_angle));
+            far_d += cam->frustum[i][j] * (cam->frustum[i][j] >= 0 ? b->max[j] : b->min[j]);
+            near_d += cam->frustum[i][j] * (cam->frustum[i][j] >= 0 ? b->min[j] : b->max[j]);
         }
+        
+        if(far_d < 0)
+            return FRUSTUM_OUTSIDE;
+            
+        if(near_d < 0)
+            ret = FRUSTUM_PARTIAL;
     }
+    
+    return ret;
 }
 
-void rotate_object_z_global(object* obj, float angle) {
+void init_camera(camera *cam) {
+    
+    cam->x = cam->y = cam->z = 0.0;
+    cam->yaw = 0.0;
+    update_camera(cam);
+}
+
+//Walk the camera along its own right and forward directions
+void move_camera(camera *cam, float right, float forward) {
+    
+    float c = cos(DEG_TO_RAD(cam->yaw)), s = sin(DEG_TO_RAD(cam->yaw));
+    
+    cam->x += right*c + forward*s;
+    cam->z += forward*c - right*s;
+}
+
+//Set an interpolator up to take count attributes from from to to over den
+//steps. A den of zero leaves them where they start
+void interp_start(interp *it, int count, int den, int *from, int *to) {
+    
+    int i;
+    
+    it->count = count;
+    it->den = den > 0 ? den : 1;
+    
+    for(i = 0; i < count; i++) {
+        
+        it->value[i] = from[i];
+        it->step[i] = den > 0 ? (to[i] - from[i]) / den : 0;
+        it->rem[i] = den > 0 ? (to[i] - from[i]) % den : 0;
+        it->err[i] = 0;
+        
+        //Division rounds toward zero, and the error has to count up
+        if(it->rem[i] < 0) {
+            
+            it->step[i]--;
+            it->rem[i] += it->den;
+        }
+    }
+}
+
+void interp_step(interp *it) {
+    
+    int i;
+    
+    for(i = 0; i < it->count; i++) {
+        
+        it->value[i] += it->step[i];
+        it->err[i] += it->rem[i];
+        
+        if(it->err[i] >= it->den) {
+            
+            it->value[i]++;
+            it->err[i] -= it->den;
+        }
+    }
+}
+
+//Take n steps at once, for starting partway along
+void interp_skip(interp *it, int n) {
+    
+    int i, e;
+    
+    if(n <= 0)
+        return;
+        
+    for(i = 0; i < it->count; i++) {
+        
+        e = it->err[i] + it->rem[i] * n;
+        it->value[i] += it->step[i] * n + e / it->den;
+        it->err[i] = e % it->den;
+    }
+}
+
+//Set an interpolator up on the edge from a down to b, already stepped to row
+void start_edge(interp *it, screen_point *a, screen_point *b, int row) {
+    
+    int from[EDGE_ATTRS], to[EDGE_ATTRS];
+    
+    from[EDGE_X] = a->x;
+    from[EDGE_Z] = a->z;
+    to[EDGE_X] = b->x;
+    to[EDGE_Z] = b->z;
+    interp_start(it, EDGE_ATTRS, b->y - a->y, from, to);
+    interp_skip(it, row - a->y);
+}
+
+void fill_span_scalar(int addr, int count, float z, float dz, unsigned int pixel) {
+
+    unsigned short newz;
+    int i;
+
+    for(i = 0; i < count; i++, addr++) {
+
+        newz = (unsigned short)(z >= 65535 ? 65535 : z < 0 ? 0 : z);
+
+        if(newz < zbuf[addr]) {
+
+            fbuf[addr] = pixel;
+            zbuf[addr] = newz;
+        }
+
+        z += dz;
+    }
+}
+
+//Write a run of pixels without looking at what's in the z-buffer, for when
+//it's already known that every one of them is nearer
+void store_span(int addr, int count, float z, float dz, unsigned int pixel) {
+
+    float newz_f;
+    int i;
+
+    for(i = 0; i < count; i++) {
+
+        newz_f = z + dz*i;
+        zbuf[addr + i] = (unsigned short)(newz_f >= 65535 ? 65535 : newz_f < 0 ? 0 : newz_f);
+        fbuf[addr + i] = pixel;
+    }
+}
+
+void gouraud_span_scalar(int addr, int count, float z, float dz, int *c, int *dc, int test) {
+    
+    unsigned short newz;
+    int i, r = c[0], g = c[1], b = c[2];
+    
+    for(i = 0; i < count; i++, addr++) {
+        
+        newz = (unsigned short)(z >= 65535 ? 65535 : z < 0 ? 0 : z);
+        
+        if(!test || newz < zbuf[addr]) {
+            
+            fbuf[addr] = TO_PIXEL(r >> 16, g >> 16, b >> 16);
+            zbuf[addr] = newz;
+        }
+        
+        z += dz;
+        r += dc[0];
+        g += dc[1];
+        b += dc[2];
+    }
+}
+
+//Texture a run of pixels with perspective correction, depth testing them
+//first if test is set. The divide only happens every TEX_SUBSPAN pixels, and
+//u and v step linearly in 16.16 fixed point in between, counted from the
+//texel they started the piece in so the wrap is a mask. Texels from the
+//surface cache are already lit and are written as they are
+void texture_span(tri_setup *rec, int addr, int count, float z, float dz, int test) {
+    
+    texture *tex = rec->tex;
+    unsigned int *texels = rec->texels, t;
+    int w_shift = tex->w_shift[rec->mip], h_shift = tex->h_shift[rec->mip];
+    int u_mask = (1 << w_shift) - 1, v_mask = (1 << h_shift) - 1;
+    int x = addr % SCREEN_WIDTH, y = addr / SCREEN_WIDTH, i, n, base_u, base_v;
+    float uw, vw, iw, u0, v0, u1, v1;
+    long u, v, du, dv;
+    unsigned short newz;
+    
+    uw = rec->tex_plane[0][0]*x + rec->tex_plane[0][1]*y + rec->tex_plane[0][2];
+    vw = rec->tex_plane[1][0]*x + rec->tex_plane[1][1]*y + rec->tex_plane[1][2];
+    iw = rec->tex_plane[2][0]*x + rec->tex_plane[2][1]*y + rec->tex_plane[2][2];
+    
+    //1/w can only go to zero or below by rounding right at the edge
+    u0 = iw > 0 ? uw / iw * (1 << w_shift) : 0;
+    v0 = iw > 0 ? vw / iw * (1 << h_shift) : 0;
+    
+    while(count > 0) {
+        
+        n = count > TEX_SUBSPAN ? TEX_SUBSPAN : count;
+        uw += rec->tex_plane[0][0] * n;
+        vw += rec->tex_plane[1][0] * n;
+        iw += rec->tex_plane[2][0] * n;
+        u1 = iw > 0 ? uw / iw * (1 << w_shift) : u0;
+        v1 = iw > 0 ? vw / iw * (1 << h_shift) : v0;
+        base_u = (int)floor(u0);
+        base_v = (int)floor(v0);
+        u = (long)((u0 - base_u) * 65536);
+        v = (long)((v0 - base_v) * 65536);
+        du = (long)((u1 - u0) * 65536 / n);
+        dv = (long)((v1 - v0) * 65536 / n);
+        
+        for(i = 0; i < n; i++, addr++) {
+            
+            newz = (unsigned short)(z >= 65535 ? 65535 : z < 0 ? 0 : z);
+            
+            if(!test || newz < zbuf[addr]) {
+                
+                t = texels[TEX_BLOCK_INDEX((base_u + (int)(u >> 16)) & u_mask, (base_v + (int)(v >> 16)) & v_mask, w_shift)];
+                fbuf[addr] = rec->lit ? t : TEX_MODULATE(t, rec->light);
+                zbuf[addr] = newz;
+            }
+            
+            u += du;
+            v += dv;
+            z += dz;
+        }
+        
+        u0 = u1;
+        v0 = v1;
+        count -= n;
+    }
+}
+
+#ifdef HAVE_X86_SIMD
+
+//Eight pixels per iteration. SSE2 has no unsigned 16-bit compare, but a
+//saturating old - new is nonzero exactly where the new depth is nearer, and
+//packing is done biased by 32768 since only a signed saturating pack exists
+TARGET_SSE2 void fill_span_sse2(int addr, int count, float z, float dz, unsigned int pixel) {
+
+    __m128 z_lo, z_hi, z_step, z_min, z_max;
+    __m128i new_z, old_z, keep, keep_lo, keep_hi, c, bias, flip, zero;
+
+    z_step = _mm_set1_ps(dz);
+    z_lo = _mm_add_ps(_mm_set1_ps(z), _mm_mul_ps(_mm_set_ps(3.0, 2.0, 1.0, 0.0), z_step));
+    z_hi = _mm_add_ps(z_lo, _mm_mul_ps(_mm_set1_ps(4.0), z_step));
+    z_step = _mm_mul_ps(_mm_set1_ps(8.0), z_step);
+    z_min = _mm_setzero_ps();
+    z_max = _mm_set1_ps(65535.0);
+    c = _mm_set1_epi32((int)pixel);
+    bias = _mm_set1_epi32(32768);
+    flip = _mm_set1_epi16((short)0x8000);
+    zero = _mm_setzero_si128();
+
+    for(; count >= 8; count -= 8, addr += 8) {
+
+        new_z = _mm_packs_epi32(
+            _mm_sub_epi32(_mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(z_lo, z_min), z_max)), bias),
+            _mm_sub_epi32(_mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(z_hi, z_min), z_max)), bias));
+        new_z = _mm_xor_si128(new_z, flip);
+        old_z = _mm_loadu_si128((__m128i*)&zbuf[addr]);
+
+        //All ones wherever the pixel already in the buffer wins
+        keep = _mm_cmpeq_epi16(_mm_subs_epu16(old_z, new_z), zero);
+        _mm_storeu_si128((__m128i*)&zbuf[addr], 
+            _mm_or_si128(_mm_and_si128(keep, old_z), _mm_andnot_si128(keep, new_z)));
+
+        keep_lo = _mm_unpacklo_epi16(keep, keep);
+        keep_hi = _mm_unpackhi_epi16(keep, keep);
+        _mm_storeu_si128((__m128i*)&fbuf[addr], 
+            _mm_or_si128(_mm_and_si128(keep_lo, _mm_loadu_si128((__m128i*)&fbuf[addr])), _mm_andnot_si128(keep_lo, c)));
+        _mm_storeu_si128((__m128i*)&fbuf[addr + 4], 
+            _mm_or_si128(_mm_and_si128(keep_hi, _mm_loadu_si128((__m128i*)&fbuf[addr + 4])), _mm_andnot_si128(keep_hi, c)));
+
+        z_lo = _mm_add_ps(z_lo, z_step);
+        z_hi = _mm_add_ps(z_hi, z_step);
+        z += 8*dz;
+    }
+
+    fill_span_scalar(addr, count, z, dz, pixel);
+}
+
+//Sixteen pixels per iteration, with anything left over going through the
+//eight-wide kernel and then the scalar tail
+TARGET_AVX2 void fill_span_avx2(int addr, int count, float z, float dz, unsigned int pixel) {
+
+    __m256 z_lo, z_hi, z_step, z_min, z_max;
+    __m256i new_z, old_z, keep, keep_lo, keep_hi, c, zero;
+
+    if(count < 16) {
+
+        fill_span_sse2(addr, count, z, dz, pixel);
+        return;
+    }
+
+    z_step = _mm256_set1_ps(dz);
+    z_lo = _mm256_add_ps(_mm256_set1_ps(z), _mm256_mul_ps(_mm256_set_ps(7.0, 6.0, 5.0, 4.0, 3.0, 2.0, 1.0, 0.0), z_step));
+    z_hi = _mm256_add_ps(z_lo, _mm256_mul_ps(_mm256_set1_ps(8.0), z_step));
+    z_step = _mm256_mul_ps(_mm256_set1_ps(16.0), z_step);
+    z_min = _mm256_setzero_ps();
+    z_max = _mm256_set1_ps(65535.0);
+    c = _mm256_set1_epi32((int)pixel);
+    zero = _mm256_setzero_si256();
+
+    for(; count >= 16; count -= 16, addr += 16) {
+
+        //The pack works within 128-bit lanes, so put the quadwords back in order
+        new_z = _mm256_packus_epi32(
+            _mm256_cvttps_epi32(_mm256_min_ps(_mm256_max_ps(z_lo, z_min), z_max)),
+            _mm256_cvttps_epi32(_mm256_min_ps(_mm256_max_ps(z_hi, z_min), z_max)));
+        new_z = _mm256_permute4x64_epi64(new_z, 0xD8);
+        old_z = _mm256_loadu_si256((__m256i*)&zbuf[addr]);
+
+        keep = _mm256_cmpeq_epi16(_mm256_subs_epu16(old_z, new_z), zero);
+        _mm256_storeu_si256((__m256i*)&zbuf[addr], _mm256_blendv_epi8(new_z, old_z, keep));
+
+        keep_lo = _mm256_cvtepi16_epi32(_mm256_castsi256_si128(keep));
+        keep_hi = _mm256_cvtepi16_epi32(_mm256_extracti128_si256(keep, 1));
+        _mm256_storeu_si256((__m256i*)&fbuf[addr], 
+            _mm256_blendv_epi8(c, _mm256_loadu_si256((__m256i*)&fbuf[addr]), keep_lo));
+        _mm256_storeu_si256((__m256i*)&fbuf[addr + 8], 
+            _mm256_blendv_epi8(c, _mm256_loadu_si256((__m256i*)&fbuf[addr + 8]), keep_hi));
+
+        z_lo = _mm256_add_ps(z_lo, z_step);
+        z_hi = _mm256_add_ps(z_hi, z_step);
+        z += 16*dz;
+    }
+
+    fill_span_sse2(addr, count, z, dz, pixel);
+}
+
+//Eight pixels per iteration, tested the same way as fill_span_sse2. Each
+//channel steps as two vectors of four 16.16 values, and since they never
+//leave 0 to 255 their whole parts can be masked straight into place
+TARGET_SSE2 void gouraud_span_sse2(int addr, int count, float z, float dz, int *c, int *dc, int test) {
+
+    __m128 z_lo, z_hi, z_step, z_min, z_max;
+    __m128i new_z, old_z, keep, keep_lo, keep_hi, bias, flip, zero, alpha, mask_r, mask_g;
+    __m128i lo[3], hi[3], step[3], p_lo, p_hi;
+    int i, end[3];
+
+    z_step = _mm_set1_ps(dz);
+    z_lo = _mm_add_ps(_mm_set1_ps(z), _mm_mul_ps(_mm_set_ps(3.0, 2.0, 1.0, 0.0), z_step));
+    z_hi = _mm_add_ps(z_lo, _mm_mul_ps(_mm_set1_ps(4.0), z_step));
+    z_step = _mm_mul_ps(_mm_set1_ps(8.0), z_step);
+    z_min = _mm_setzero_ps();
+    z_max = _mm_set1_ps(65535.0);
+    bias = _mm_set1_epi32(32768);
+    flip = _mm_set1_epi16((short)0x8000);
+    zero = _mm_setzero_si128();
+    alpha = _mm_set1_epi32((int)0xFF000000);
+    mask_r = _mm_set1_epi32(0x00FF0000);
+    mask_g = _mm_set1_epi32(0x0000FF00);
+    
+    for(i = 0; i < 3; i++) {
+        
+        lo[i] = _mm_add_epi32(_mm_set1_epi32(c[i]), _mm_set_epi32(3*dc[i], 2*dc[i], dc[i], 0));
+        hi[i] = _mm_add_epi32(lo[i], _mm_set1_epi32(4*dc[i]));
+        step[i] = _mm_set1_epi32(8*dc[i]);
+        end[i] = c[i] + (count & ~7)*dc[i];
+    }
+
+    for(; count >= 8; count -= 8, addr += 8) {
+
+        new_z = _mm_packs_epi32(
+            _mm_sub_epi32(_mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(z_lo, z_min), z_max)), bias),
+            _mm_sub_epi32(_mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(z_hi, z_min), z_max)), bias));
+        new_z = _mm_xor_si128(new_z, flip);
+        old_z = _mm_loadu_si128((__m128i*)&zbuf[addr]);
+        
+        //Without the test nothing already there is kept
+        keep = test ? _mm_cmpeq_epi16(_mm_subs_epu16(old_z, new_z), zero) : zero;
+        
+        _mm_storeu_si128((__m128i*)&zbuf[addr], 
+            _mm_or_si128(_mm_and_si128(keep, old_z), _mm_andnot_si128(keep, new_z)));
+            
+        p_lo = _mm_or_si128(_mm_or_si128(alpha, _mm_and_si128(lo[0], mask_r)),
+                            _mm_or_si128(_mm_and_si128(_mm_srli_epi32(lo[1], 8), mask_g), _mm_srli_epi32(lo[2], 16)));
+        p_hi = _mm_or_si128(_mm_or_si128(alpha, _mm_and_si128(hi[0], mask_r)),
+                            _mm_or_si128(_mm_and_si128(_mm_srli_epi32(hi[1], 8), mask_g), _mm_srli_epi32(hi[2], 16)));
+
+        keep_lo = _mm_unpacklo_epi16(keep, keep);
+        keep_hi = _mm_unpackhi_epi16(keep, keep);
+        _mm_storeu_si128((__m128i*)&fbuf[addr], 
+            _mm_or_si128(_mm_and_si128(keep_lo, _mm_loadu_si128((__m128i*)&fbuf[addr])), _mm_andnot_si128(keep_lo, p_lo)));
+        _mm_storeu_si128((__m128i*)&fbuf[addr + 4], 
+            _mm_or_si128(_mm_and_si128(keep_hi, _mm_loadu_si128((__m128i*)&fbuf[addr + 4])), _mm_andnot_si128(keep_hi, p_hi)));
+
+        for(i = 0; i < 3; i++) {
+            
+            lo[i] = _mm_add_epi32(lo[i], step[i]);
+            hi[i] = _mm_add_epi32(hi[i], step[i]);
+        }
+        
+        z_lo = _mm_add_ps(z_lo, z_step);
+        z_hi = _mm_add_ps(z_hi, z_step);
+        z += 8*dz;
+    }
+
+    gouraud_span_scalar(addr, count, z, dz, end, dc, test);
+}
+
+#endif
+
+span_func fill_span = fill_span_scalar;
+gouraud_func gouraud_span = gouraud_span_scalar;
+
+//Pick the widest span kernel the CPU we're running on can handle
+void init_span_kernel() {
+
+    char *name = "scalar";
+
+    fill_span = fill_span_scalar;
+    gouraud_span = gouraud_span_scalar;
+
+#ifdef HAVE_X86_SIMD
+    if(SDL_HasAVX2()) {
+
+        fill_span = fill_span_avx2;
+        gouraud_span = gouraud_span_sse2;
+        name = "AVX2";
+    } else if(SDL_HasSSE2()) {
+
+        fill_span = fill_span_sse2;
+        gouraud_span = gouraud_span_sse2;
+        name = "SSE2";
+    }
+#endif
+
+    printf("Span kernel: %s\n", name);
+}
+
+void project(vertex* v, screen_point* p) {
+
+    //x and y were already scaled by the focal length on the way into clip space
+    float delta = (v->z == 0.0) ? 1.0 : (1.0/v->z);
+
+    p->x = TO_SCREEN_X(v->x * delta);
+    p->y = TO_SCREEN_Y(v->y * delta);
+    p->z = TO_SCREEN_Z(v->z);
+}
+
+//Work out the color at the first of a run of count pixels starting at x, y,
+//and its change per pixel, from the same planes sample_color uses, in the
+//16.16 fixed point the span kernels step it in. The ends are clamped the way
+//sample_color clamps, so nothing in between leaves 0 to 255, and starting
+//half a step in rounds the same way it does
+void start_span_color(tri_setup *rec, int x, int y, int count, int *c, int *dc) {
+    
+    int i;
+    float first, last;
+    
+    for(i = 0; i < 3; i++) {
+        
+        first = rec->color_plane[i][0]*x + rec->color_plane[i][1]*y + rec->color_plane[i][2];
+        last = first + rec->color_plane[i][0]*(count - 1);
+        first = first > 255 ? 255 : first < 0 ? 0 : first;
+        last = last > 255 ? 255 : last < 0 ? 0 : last;
+        dc[i] = count > 1 ? (int)((last - first) * 65536 / (count - 1)) : 0;
+        c[i] = (int)(first * 65536) + 32768;
+    }
+}
+
+//Send a depth tested run of a triangle's pixels to the kernel that shades
+//it. For Gouraud shading, the run starts skip pixels on from where c has the
+//span's color
+void fill_run(tri_setup *rec, int addr, int count, float z, float dz, int *c, int *dc, int skip) {
+    
+    int run_c[3];
+    
+    if(rec->textured) {
+        
+        texture_span(rec, addr, count, z, dz, 1);
+    } else if(rec->gouraud) {
+        
+        run_c[0] = c[0] + dc[0] * skip;
+        run_c[1] = c[1] + dc[1] * skip;
+        run_c[2] = c[2] + dc[2] * skip;
+        gouraud_span(addr, count, z, dz, run_c, dc, 1);
+    } else {
+        
+        fill_span(addr, count, z, dz, rec->pixel);
+    }
+}
+
+//Draw a line along the scanline between where it crosses two of the
+//triangle's edges, a and b, each an interpolator's attributes, and only draw
+//the pixels where the interpolated z-value is less than the value already
+//written to the z-buffer
+void draw_scanline(tri_setup *rec, unsigned short far_z, rect* clip, int scanline, int *a, int *b) {
+
+    int first, last, x, n, len, tile, row, run_x, start_x, *t, c[3], dc[3];
+	float x0, z0, x1, z1, dz, dx, m, z, run_z, near_f; 
+	unsigned short near_z;
+      
+    if(a[EDGE_X] > b[EDGE_X]) {
+     
+        t = a;
+        a = b;
+        b = t;
+    } 
+    
+    x0 = a[EDGE_X];
+    z0 = a[EDGE_Z];
+    x1 = b[EDGE_X];
+    z1 = b[EDGE_Z];
+	dz = z1 - z0;
+    dx = x1 - x0;
+    m = dx ? dz/dx : 0;
+    
+    //Pixels sit at x0, x0 + 1, ... up to x1. Work out the first and last of
+    //those that land inside the clip rectangle so the span kernel doesn't have
+    //to check
+    first = x0 < clip->x0 ? (int)ceil(clip->x0 - x0) : 0;
+    last = x1 >= clip->x1 + 1 ? (int)ceil(clip->x1 + 1 - x0) - 1 : (int)(x1 - x0);
+    
+    if(last < first)
+        return;
+    
+    if(rec->gouraud)
+        start_span_color(rec, (int)x0 + first, scanline, last - first + 1, c, dc);
+    
+    x0 += first;
+    x = run_x = start_x = (int)x0;
+    z = run_z = m*(x0 - x1) + z1;
+    n = last - first + 1;
+    row = scanline * SCREEN_WIDTH;
+    
+    //Go through the span a tile at a time, dropping the pieces that the
+    //hierarchical z says are hidden and sending the rest to the span kernel
+    //in as few runs as possible
+    while(n > 0) {
+        
+        len = BLOCK_SIZE - (x % BLOCK_SIZE);
+        len = len > n ? n : len;
+        tile = (scanline / BLOCK_SIZE) * TILES_X + x / BLOCK_SIZE;
+        near_f = m > 0 ? z : z + m*(len - 1);
+        near_z = (unsigned short)(near_f >= 65535 ? 65535 : near_f < 0 ? 0 : near_f);
+        
+        if(tile_epoch[tile] == frame_epoch && tile_zmax[tile] <= near_z) {
+            
+            if(x > run_x)
+                fill_run(rec, row + run_x, x - run_x, run_z, m, c, dc, run_x - start_x);
+            
+            run_x = x + len;
+            run_z = z + m*len;
+        } else {
+            
+            touch_tile(tile);
+            
+            if(near_z < tile_zmin[tile])
+                tile_zmin[tile] = near_z;
+                
+            //Once the triangle has covered the whole tile nothing in it can
+            //be any farther than the triangle's farthest point
+            tile_cover[tile] += len;
+            
+            if(tile_cover[tile] == BLOCK_SIZE*BLOCK_SIZE && far_z < tile_zmax[tile])
+                tile_zmax[tile] = far_z;
+        }
+        
+        x += len;
+        z += m*len;
+        n -= len;
+    }
+    
+    if(x > run_x)
+        fill_run(rec, row + run_x, x - run_x, run_z, m, c, dc, run_x - start_x);
+}
+
+//Mark pixels x0 through x1 of a scanline as covered in a span list, merging
+//the new run with any it touches
+void span_list_insert(span_list *list, int x0, int x1) {
+    
+    int i, j, n = 0;
+    short nx0[SPAN_LIST_MAX], nx1[SPAN_LIST_MAX];
+    
+    for(i = 0; i < list->count && list->x1[i] < x0 - 1; i++, n++) {
+        
+        nx0[n] = list->x0[i];
+        nx1[n] = list->x1[i];
+    }
+    
+    for(j = i; j < list->count && list->x0[j] <= x1 + 1; j++) {
+        
+        x0 = list->x0[j] < x0 ? list->x0[j] : x0;
+        x1 = list->x1[j] > x1 ? list->x1[j] : x1;
+    }
+    
+    nx0[n] = x0;
+    nx1[n++] = x1;
+    
+    for(; j < list->count; j++, n++) {
+        
+        nx0[n] = list->x0[j];
+        nx1[n] = list->x1[j];
+    }
+    
+    memcpy(list->x0, nx0, n * sizeof(short));
+    memcpy(list->x1, nx1, n * sizeof(short));
+    list->count = n;
+}
+
+//Write a run of static scenery that nothing has covered yet, keeping the
+//hierarchical z up to date the same way draw_scanline does. c and dc are
+//the span's color as for fill_run, with the gap starting skip pixels on
+void store_gap(tri_setup *rec, unsigned short far_z, int scanline, int x, int n, float z, float m, int *c, int *dc, int skip) {
+    
+    int len, tile, gap_c[3];
+    float near_f;
+    unsigned short near_z;
+    
+    if(rec->textured) {
+        
+        texture_span(rec, scanline * SCREEN_WIDTH + x, n, z, m, 0);
+    } else if(rec->gouraud) {
+        
+        gap_c[0] = c[0] + dc[0] * skip;
+        gap_c[1] = c[1] + dc[1] * skip;
+        gap_c[2] = c[2] + dc[2] * skip;
+        gouraud_span(scanline * SCREEN_WIDTH + x, n, z, m, gap_c, dc, 0);
+    } else {
+        
+        store_span(scanline * SCREEN_WIDTH + x, n, z, m, rec->pixel);
+    }
+    
+    while(n > 0) {
+        
+        len = BLOCK_SIZE - (x % BLOCK_SIZE);
+        len = len > n ? n : len;
+        tile = (scanline / BLOCK_SIZE) * TILES_X + x / BLOCK_SIZE;
+        near_f = m > 0 ? z : z + m*(len - 1);
+        near_z = (unsigned short)(near_f >= 65535 ? 65535 : near_f < 0 ? 0 : near_f);
+        
+        if(near_z < tile_zmin[tile])
+            tile_zmin[tile] = near_z;
+            
+        tile_cover[tile] += len;
+        
+        if(tile_cover[tile] == BLOCK_SIZE*BLOCK_SIZE && far_z < tile_zmax[tile])
+            tile_zmax[tile] = far_z;
+            
+        x += len;
+        z += m*len;
+        n -= len;
+    }
+}
+
+//The span buffer version of draw_scanline, for static scenery coming in front
+//to back. Whatever is already covered on the scanline was drawn by something
+//nearer, so the span is cut down to the gaps between covered runs before any
+//pixel is looked at, and those are written without a depth test. Depth is
+//still written so that what's drawn after the scenery can test against it
+void draw_scanline_spans(tri_setup *rec, unsigned short far_z, rect* clip, int row, int *a, int *b) {
+
+    int first, last, x, end, gap, i, *t, c[3], dc[3];
+    float x0, z0, x1, z1, dx, m, z;
+    span_list *list;
+    
+    if(a[EDGE_X] > b[EDGE_X]) {
+     
+        t = a;
+        a = b;
+        b = t;
+    }
+    
+    x0 = a[EDGE_X];
+    z0 = a[EDGE_Z];
+    x1 = b[EDGE_X];
+    z1 = b[EDGE_Z];
+    dx = x1 - x0;
+    m = dx ? (z1 - z0)/dx : 0;
+    first = x0 < clip->x0 ? (int)ceil(clip->x0 - x0) : 0;
+    last = x1 >= clip->x1 + 1 ? (int)ceil(clip->x1 + 1 - x0) - 1 : (int)(x1 - x0);
+    
+    if(last < first)
+        return;
+        
+    if(rec->gouraud)
+        start_span_color(rec, (int)x0 + first, row, last - first + 1, c, dc);
+        
+    x0 += first;
+    x = (int)x0;
+    end = x + last - first;
+    z = m*(x0 - x1) + z1;
+    list = &span_lists[row][clip->x0 / BIN_SIZE];
+    
+    if(list->epoch != frame_epoch) {
+        
+        list->epoch = frame_epoch;
+        list->count = 0;
+    }
+    
+    touch_span(row, x, end);
+    
+    //Fill in front of each covered run that the span reaches, then skip
+    //over the run
+    for(i = 0, gap = x; i < list->count && list->x0[i] <= end; i++) {
+        
+        if(list->x1[i] < gap)
+            continue;
+            
+        if(list->x0[i] > gap)
+            store_gap(rec, far_z, row, gap, list->x0[i] - gap, z + m*(gap - x), m, c, dc, gap - x);
+            
+        gap = list->x1[i] + 1;
+    }
+    
+    if(gap <= end)
+        store_gap(rec, far_z, row, gap, end - gap + 1, z + m*(gap - x), m, c, dc, gap - x);
+        
+    span_list_insert(list, x, end);
+}
+
+//Draw an rgb-colored line along the scanline from x=x1 to x=x2, interpolating
+//z-values and only drawing the pixel if the interpolated z-value is less than
+//the value already written to the z-buffer
+void draw_scanline_old(int scanline, int x0, int z0, int x1, int z1) {
+
+    int dx, sx, dz, sz, err, te, z_addr;	
+	   
+    //don't draw off the screen
+    if(scanline >= SCREEN_HEIGHT || scanline < 0)
+    	return;
+	    
+    dx = abs(x1 - x0);
+    sx = x0 < x1 ? 1 : -1;
+    dz = abs(z1 - z0);
+    sz = z0 < z1 ? 1 : -1;
+    err = (dx > dz ? dx : dz) / 2;
+	z_addr = scanline * SCREEN_WIDTH + x0;
+       
+    while(1) {
+        
+        
+	if(x0 < SCREEN_WIDTH && x0 >= 0) {
+        
+            touch_span(scanline, x0, x0);
+        
+	    //Check the z buffer and draw the point	
+	    if(z0 < zbuf[z_addr]) {
+            
+                //Uncomment the below to view the depth buffer
+                fbuf[z_addr] = TO_PIXEL(z0 >> 8, z0 >> 8, z0 >> 8);
+                zbuf[z_addr] = (unsigned short)z0;
+           }
+	}
+        
+        //Do the next step of z-interpolation along x
+		if(x0 == x1)
+            return;
+            
+		te = err;
+        
+		if(te > -dx) {
+            
+            err -= dz;
+            x0 += sx;
+            z_addr +=sx;
+        } 
+        
+		if(te < dz) {
+            
+            err += dx;
+            z0 += sz; 
+        }
+    }
+}
+
+//Rasterize a projected triangle using integer edge functions. The bounding box
+//is walked in BLOCK_SIZE square blocks and each edge is evaluated at the block
+//corners, so blocks wholly outside the triangle are skipped and blocks wholly
+//inside it are filled without any per-pixel coverage tests. Only blocks that
+//straddle an edge step the edge functions per pixel. Depth is interpolated off
+//of a plane equation, which keeps every pixel independent of its neighbours
+void fill_triangle_edge(tri_setup* rec, rect* clip) {
+
+    int i, j, x, y, bx, by, min_x, min_y, max_x, max_y, addr, tile;
+    int a, b;
+    long long area, t;
+    long long ea[3], eb[3], ec[3];
+    long long e_block[3], e_row[3], e_pix[3];
+    long long e_max, e_min;
+    int full, out, px0, px1, py0, py1;
+    double dzdx, dzdy, z_origin;
+    float z_row, z_pix, block_near, block_far;
+    unsigned short newz, block_near_z, block_far_z;
+    unsigned short near_z = rec->near_z, far_z = rec->far_z;
+    unsigned int pixel = rec->pixel;
+    screen_point* p = rec->p;
+    screen_point v[3];
+
+    for(i = 0; i < 3; i++)
+        v[i] = p[i];
+
+    //Twice the signed area. Flip the winding if needed so that the inside of
+    //every edge is on its positive side
+    area = (long long)(v[1].x - v[0].x) * (v[2].y - v[0].y) - 
+           (long long)(v[1].y - v[0].y) * (v[2].x - v[0].x);
+
+    if(area == 0)
+        return;
+
+    if(area < 0) {
+
+        v[1] = p[2];
+        v[2] = p[1];
+        area = -area;
+    }
+
+    //Bounding box, clipped to the clip rectangle
+    min_x = rec->bounds.x0 < clip->x0 ? clip->x0 : rec->bounds.x0;
+    min_y = rec->bounds.y0 < clip->y0 ? clip->y0 : rec->bounds.y0;
+    max_x = rec->bounds.x1 > clip->x1 ? clip->x1 : rec->bounds.x1;
+    max_y = rec->bounds.y1 > clip->y1 ? clip->y1 : rec->bounds.y1;
+
+    if(min_x > max_x || min_y > max_y)
+        return;
+
+    //Edge i runs opposite vertex i, from vertex a to vertex b, and evaluates
+    //as ea*x + eb*y + ec
+    for(i = 0; i < 3; i++) {
+
+        a = (i + 1) % 3;
+        b = (i + 2) % 3;
+        ea[i] = v[a].y - v[b].y;
+        eb[i] = v[b].x - v[a].x;
+        ec[i] = (long long)v[a].x * v[b].y - (long long)v[b].x * v[a].y;
+    }
+
+    //Edge i is the barycentric weight of vertex i, so the depth plane falls
+    //right out of the edge coefficients
+    dzdx = (double)(ea[0]*v[0].z + ea[1]*v[1].z + ea[2]*v[2].z) / area;
+    dzdy = (double)(eb[0]*v[0].z + eb[1]*v[1].z + eb[2]*v[2].z) / area;
+    z_origin = ((double)ec[0]*v[0].z + (double)ec[1]*v[1].z + (double)ec[2]*v[2].z) / area;
+
+    //Top-left fill rule: pixels exactly on an edge belong to the triangle
+    //only if that edge is a top or a left one, so shared edges aren't
+    //drawn twice
+    for(i = 0; i < 3; i++)
+        if(!(ea[i] > 0 || (ea[i] == 0 && eb[i] > 0)))
+            ec[i]--;
+
+    for(by = min_y & ~(BLOCK_SIZE - 1); by <= max_y; by += BLOCK_SIZE) {
+
+        for(bx = min_x & ~(BLOCK_SIZE - 1); bx <= max_x; bx += BLOCK_SIZE) {
+
+            full = 1;
+            out = 0;
+
+            //Find the extremes of each edge over the block's corners
+            for(i = 0; i < 3; i++) {
+
+                e_block[i] = ea[i]*bx + eb[i]*by + ec[i];
+                e_max = e_min = e_block[i];
+                t = ea[i] * (BLOCK_SIZE - 1);
+                
+                if(t > 0) e_max += t; else e_min += t;
+                    
+                t = eb[i] * (BLOCK_SIZE - 1);
+                
+                if(t > 0) e_max += t; else e_min += t;
+
+                if(e_max < 0)
+                    out = 1;
+
+                if(e_min < 0)
+                    full = 0;
+            }
+
+            if(out)
+                continue;
+                
+            //Blocks aren't aligned to the clip rectangle, which a portal's
+            //scissor can put anywhere, so only a block entirely inside it
+            //can be drawn whole
+            if(bx < min_x || by < min_y || bx + BLOCK_SIZE - 1 > max_x || by + BLOCK_SIZE - 1 > max_y)
+                full = 0;
+
+            //Depth range of the triangle's plane over the block, which can't
+            //be any wider than the range of the triangle itself
+            z_row = (float)(z_origin + dzdx*bx + dzdy*by);
+            block_near = z_row + (dzdx < 0 ? dzdx*(BLOCK_SIZE - 1) : 0) + (dzdy < 0 ? dzdy*(BLOCK_SIZE - 1) : 0);
+            block_far = z_row + (dzdx > 0 ? dzdx*(BLOCK_SIZE - 1) : 0) + (dzdy > 0 ? dzdy*(BLOCK_SIZE - 1) : 0);
+            block_near_z = block_near < near_z ? near_z : block_near >= 65535 ? 65535 : (unsigned short)block_near;
+            block_far_z = block_far > far_z ? far_z : block_far < 0 ? 0 : (unsigned short)block_far;
+            tile = (by / BLOCK_SIZE) * TILES_X + bx / BLOCK_SIZE;
+
+            //Skip the block if everything already in the tile is nearer
+            if(tile_epoch[tile] == frame_epoch && tile_zmax[tile] <= block_near_z)
+                continue;
+
+            touch_tile(tile);
+            addr = by * SCREEN_WIDTH + bx;
+
+            if(full) {
+
+                //Trivially accepted, only the depth test is left to do. And if
+                //the whole block is nearer than anything in the tile, not even
+                //that
+                if(block_far_z < tile_zmin[tile]) {
+
+                    for(y = 0; y < BLOCK_SIZE; y++, addr += SCREEN_WIDTH) {
+
+                        store_span(addr, BLOCK_SIZE, z_row, dzdx, pixel);
+                        z_row += dzdy;
+                    }
+                } else {
+
+                    for(y = 0; y < BLOCK_SIZE; y++, addr += SCREEN_WIDTH) {
+
+                        fill_span(addr, BLOCK_SIZE, z_row, dzdx, pixel);
+                        z_row += dzdy;
+                    }
+                }
+
+                tile_zmin[tile] = block_near_z < tile_zmin[tile] ? block_near_z : tile_zmin[tile];
+                tile_zmax[tile] = block_far_z < tile_zmax[tile] ? block_far_z : tile_zmax[tile];
+
+                continue;
+            }
+
+            if(block_near_z < tile_zmin[tile])
+                tile_zmin[tile] = block_near_z;
+
+            //Partially covered, step the edge functions per pixel over just
+            //the part of the block inside the clip rectangle
+            px0 = bx < min_x ? min_x - bx : 0;
+            px1 = bx + BLOCK_SIZE - 1 > max_x ? max_x - bx : BLOCK_SIZE - 1;
+            py0 = by < min_y ? min_y - by : 0;
+            py1 = by + BLOCK_SIZE - 1 > max_y ? max_y - by : BLOCK_SIZE - 1;
+            
+            for(j = 0; j < 3; j++)
+                e_row[j] = e_block[j] + ea[j]*px0 + eb[j]*py0;
+                
+            z_row += dzdx*px0 + dzdy*py0;
+            addr += py0 * SCREEN_WIDTH + px0;
+
+            for(y = py0; y <= py1; y++, addr += SCREEN_WIDTH - (px1 - px0 + 1)) {
+
+                z_pix = z_row;
+
+                for(j = 0; j < 3; j++)
+                    e_pix[j] = e_row[j];
+
+                for(x = px0; x <= px1; x++, addr++, z_pix += dzdx) {
+
+                    if((e_pix[0] | e_pix[1] | e_pix[2]) >= 0) {
+
+                        newz = (unsigned short)(z_pix >= 65535 ? 65535 : z_pix < 0 ? 0 : z_pix);
+
+                        if(newz < zbuf[addr]) {
+
+                            fbuf[addr] = pixel;
+                            zbuf[addr] = newz;
+                        }
+                    }
+
+                    for(j = 0; j < 3; j++)
+                        e_pix[j] += ea[j];
+                }
+
+                for(j = 0; j < 3; j++)
+                    e_row[j] += eb[j];
+
+                z_row += dzdy;
+            }
+        }
+    }
+}
+
+//Scan a triangle out a row at a time, walking its left and right edges
+void fill_triangle_scanline(tri_setup* rec, rect* clip) {
+
+    screen_point* p = rec->p;
+    interp long_edge, short_edge;
+    int row, end;
+    
+    //Setup has already sorted the vertices by ascending y. The long edge runs
+    //from the first to the third, and the short one from the first to the
+    //second and then on to the third. Start both at the first scanline inside
+    //the clip rectangle
+    row = p[0].y < clip->y0 ? clip->y0 : p[0].y;
+    end = p[2].y > clip->y1 + 1 ? clip->y1 + 1 : p[2].y;
+    
+    if(row >= end)
+        return;
+        
+    start_edge(&long_edge, &p[0], &p[2], row);
+    
+    if(row < p[1].y)
+        start_edge(&short_edge, &p[0], &p[1], row);
+    else
+        start_edge(&short_edge, &p[1], &p[2], row);
+    
+    for(; row < end; row++) {
+        
+        if(row == p[1].y)
+            start_edge(&short_edge, &p[1], &p[2], row);
+            
+        if(rec->span_buffered)
+            draw_scanline_spans(rec, rec->far_z, clip, row, short_edge.value, long_edge.value);
+        else
+            draw_scanline(rec, rec->far_z, clip, row, short_edge.value, long_edge.value);
+            
+        interp_step(&long_edge);
+        interp_step(&short_edge);
+    }
+}
+
+//Draw the part of a set-up triangle that falls inside the clip rectangle.
+//The bounds may have been cut down by a scissor, so the engines are only
+//given their overlap with the clip rectangle to work in
+void raster_triangle(tri_setup* rec, rect* clip) {
+    
+    int i, tx0, ty0, tx1, ty1;
+    rect area;
+    
+    area.x0 = rec->bounds.x0 < clip->x0 ? clip->x0 : rec->bounds.x0;
+    area.y0 = rec->bounds.y0 < clip->y0 ? clip->y0 : rec->bounds.y0;
+    area.x1 = rec->bounds.x1 > clip->x1 ? clip->x1 : rec->bounds.x1;
+    area.y1 = rec->bounds.y1 > clip->y1 ? clip->y1 : rec->bounds.y1;
+    
+    if(area.x0 > area.x1 || area.y0 > area.y1)
+        return;
+        
+    //If the nearest point on the triangle is behind everything in all of the
+    //tiles under its bounding box, there's nothing to draw
+    tx0 = area.x0 / BLOCK_SIZE;
+    ty0 = area.y0 / BLOCK_SIZE;
+    tx1 = area.x1 / BLOCK_SIZE;
+    ty1 = area.y1 / BLOCK_SIZE;
+    
+    if(hiz_tiles_hidden(tx0, ty0, tx1, ty1, rec->near_z))
+        return;
+    
+    //The span buffer, the texturer and Gouraud shading only work a scanline
+    //at a time. Gouraud triangles go there for the visibility buffer too, so
+    //its resolve shades the same pixels they would have covered
+    if(raster_mode == RASTER_EDGE && !rec->span_buffered && !rec->textured && !rec->smooth) {
+        
+        fill_triangle_edge(rec, &area);
+        return;
+    }
+    
+    //The scanline engine counts the pixels it lays down in each tile
+    for(i = ty0; i <= ty1; i++)
+        memset((void*)&tile_cover[i * TILES_X + tx0], 0, tx1 - tx0 + 1);
+        
+    fill_triangle_scanline(rec, &area);
+}
+
+void bin_push(bin *target, tri_setup *item) {
+    
+    bin_chunk *chunk = target->last;
+    
+    if(!chunk || chunk->count == BIN_CHUNK) {
+        
+        if(!(chunk = arena_new(&frame_arena, bin_chunk))) {
+            
+            printf("[bin_push] failed to grow bin\n");
+            return;
+        }
+        
+        chunk->count = 0;
+        chunk->next = NULL;
+        
+        if(target->last)
+            target->last->next = chunk;
+        else
+            target->first = chunk;
+            
+        target->last = chunk;
+    }
+    
+    chunk->items[chunk->count++] = item;
+    target->count++;
+}
+
+//Add a setup to every bin its bounding box overlaps
+void bin_setup(tri_setup *rec) {
+    
+    int bx, by;
+    rect *bounds = &(rec->bounds);
+    
+    for(by = bounds->y0 / BIN_SIZE; by <= bounds->y1 / BIN_SIZE; by++)
+        for(bx = bounds->x0 / BIN_SIZE; bx <= bounds->x1 / BIN_SIZE; bx++)
+            bin_push(&bins[by * BINS_X + bx], rec);
+}
+
+//Light and project a batch of triangles one at a time. Faces turned away
+//from the camera were already culled by their normals on the way in
+void setup_lanes_scalar(setup_batch *in, setup_result *out) {
+    
+    int i, j, k;
+    screen_point p[3], e;
+    int o[3], eo;
+    float lighting_pct, r, g, b;
+    
+    for(i = 0; i < SETUP_BATCH; i++) {
+        
+        out->keep[i] = !(in->z[0][i] < 0 && in->z[1][i] < 0 && in->z[2][i] < 0);
+        
+        if(!out->keep[i])
+            continue;
+        
+        //The normal is a unit vector, so its z is the cosine against the
+        //view direction
+        lighting_pct = LIGHT_FROM_COS(-in->nz[i]);
+        out->light[i] = lighting_pct;
+        r = in->r[i] * lighting_pct;
+        r = r > 255.0 ? 255 : r;     
+        g = in->g[i] * lighting_pct;
+        g = g > 255.0 ? 255 : g;
+        b = in->b[i] * lighting_pct;
+        b = b > 255.0 ? 255 : b;
+        out->pixel[i] = TO_PIXEL((unsigned char)r, (unsigned char)g, (unsigned char)b);
+        
+        for(j = 0; j < 3; j++) {
+            
+            p[j].x = in->px[j][i];
+            p[j].y = in->py[j][i];
+            p[j].z = in->pz[j][i];
+            o[j] = j;
+        }
+            
+        //sort vertices by ascending y
+        for(k = 0; k < 3; k++) {
+            
+            j = k == 1 ? 1 : 0;
+            
+            if(p[j].y > p[j + 1].y) {
+                
+                e = p[j];
+                p[j] = p[j + 1];
+                p[j + 1] = e;
+                eo = o[j];
+                o[j] = o[j + 1];
+                o[j + 1] = eo;
+            }
+        }
+        
+        for(j = 0; j < 3; j++) {
+            
+            out->x[j][i] = p[j].x;
+            out->y[j][i] = p[j].y;
+            out->z[j][i] = p[j].z;
+            out->order[j][i] = o[j];
+        }
+    }
+}
+
+#ifdef HAVE_X86_SIMD
+
+//Swap the screen points of two vertices in every lane where a's y is greater
+#define SETUP_CMPXCHG(a, b) \
+    do { \
+        swap = _mm_cmpgt_epi32(sy[a], sy[b]); \
+        t = _mm_and_si128(swap, _mm_xor_si128(sx[a], sx[b])); sx[a] = _mm_xor_si128(sx[a], t); sx[b] = _mm_xor_si128(sx[b], t); \
+        t = _mm_and_si128(swap, _mm_xor_si128(sy[a], sy[b])); sy[a] = _mm_xor_si128(sy[a], t); sy[b] = _mm_xor_si128(sy[b], t); \
+        t = _mm_and_si128(swap, _mm_xor_si128(sz[a], sz[b])); sz[a] = _mm_xor_si128(sz[a], t); sz[b] = _mm_xor_si128(sz[b], t); \
+        t = _mm_and_si128(swap, _mm_xor_si128(so[a], so[b])); so[a] = _mm_xor_si128(so[a], t); so[b] = _mm_xor_si128(so[b], t); \
+    } while(0)
+
+//The same as setup_lanes_scalar, four lanes at a time
+TARGET_SSE2 void setup_lanes_sse2(setup_batch *in, setup_result *out) {
+    
+    int i, j;
+    __m128 zero, one, half, c, light, cull;
+    __m128i sx[3], sy[3], sz[3], so[3], swap, t, pixel;
+    
+    zero = _mm_setzero_ps();
+    one = _mm_set1_ps(1.0);
+    half = _mm_set1_ps(0.5);
+    
+    for(i = 0; i < SETUP_BATCH; i += 4) {
+        
+        cull = _mm_and_ps(_mm_and_ps(_mm_cmplt_ps(_mm_loadu_ps(&in->z[0][i]), zero), 
+                                     _mm_cmplt_ps(_mm_loadu_ps(&in->z[1][i]), zero)), 
+                          _mm_cmplt_ps(_mm_loadu_ps(&in->z[2][i]), zero));
+        _mm_storeu_si128((__m128i*)&out->keep[i], _mm_xor_si128(_mm_castps_si128(cull), _mm_set1_epi32(-1)));
+        
+        //Lighting, straight from the normal's z
+        c = _mm_sub_ps(zero, _mm_loadu_ps(&in->nz[i]));
+        c = _mm_max_ps(_mm_min_ps(c, one), _mm_sub_ps(zero, one));
+        light = _mm_add_ps(half, _mm_mul_ps(half, c));
+        _mm_storeu_ps(&out->light[i], light);
+        
+        pixel = _mm_set1_epi32((int)0xFF000000);
+        pixel = _mm_or_si128(pixel, _mm_slli_epi32(_mm_cvttps_epi32(_mm_min_ps(_mm_mul_ps(_mm_loadu_ps(&in->r[i]), light), _mm_set1_ps(255.0))), 16));
+        pixel = _mm_or_si128(pixel, _mm_slli_epi32(_mm_cvttps_epi32(_mm_min_ps(_mm_mul_ps(_mm_loadu_ps(&in->g[i]), light), _mm_set1_ps(255.0))), 8));
+        pixel = _mm_or_si128(pixel, _mm_cvttps_epi32(_mm_min_ps(_mm_mul_ps(_mm_loadu_ps(&in->b[i]), light), _mm_set1_ps(255.0))));
+        _mm_storeu_si128((__m128i*)&out->pixel[i], pixel);
+        
+        for(j = 0; j < 3; j++) {
+            
+            sx[j] = _mm_loadu_si128((__m128i*)&in->px[j][i]);
+            sy[j] = _mm_loadu_si128((__m128i*)&in->py[j][i]);
+            sz[j] = _mm_loadu_si128((__m128i*)&in->pz[j][i]);
+            so[j] = _mm_set1_epi32(j);
+        }
+        
+        //Three compare-exchanges sort three vertices by ascending y
+        SETUP_CMPXCHG(0, 1);
+        SETUP_CMPXCHG(1, 2);
+        SETUP_CMPXCHG(0, 1);
+        
+        for(j = 0; j < 3; j++) {
+            
+            _mm_storeu_si128((__m128i*)&out->x[j][i], sx[j]);
+            _mm_storeu_si128((__m128i*)&out->y[j][i], sy[j]);
+            _mm_storeu_si128((__m128i*)&out->z[j][i], sz[j]);
+            _mm_storeu_si128((__m128i*)&out->order[j][i], so[j]);
+        }
+    }
+}
+
+#endif
+
+setup_func setup_lanes = setup_lanes_scalar;
+
+void init_setup_kernel() {
+    
+    char *name = "scalar";
+    
+    setup_lanes = setup_lanes_scalar;
+    
+#ifdef HAVE_X86_SIMD
+    if(SDL_HasSSE2()) {
+        
+        setup_lanes = setup_lanes_sse2;
+        name = "SSE2";
+    }
+#endif
+
+    printf("Setup kernel: %s\n", name);
+}
+
+//Twice the screen area of a setup's triangle, signed by its winding, which is
+//what setup_plane divides by
+double setup_plane_area(tri_setup *rec) {
+    
+    return (double)(rec->p[1].x - rec->p[0].x) * (rec->p[2].y - rec->p[0].y) -
+           (double)(rec->p[2].x - rec->p[0].x) * (rec->p[1].y - rec->p[0].y);
+}
+
+//Fit a plane over the screen through the values a takes at a setup's three
+//vertices, as its change along x, its change along y and its value at the
+//origin
+void setup_plane(tri_setup *rec, double area, double *a, float *plane) {
+    
+    double x1, y1, x2, y2, d1, d2;
+    
+    x1 = rec->p[1].x - rec->p[0].x;
+    y1 = rec->p[1].y - rec->p[0].y;
+    x2 = rec->p[2].x - rec->p[0].x;
+    y2 = rec->p[2].y - rec->p[0].y;
+    d1 = a[1] - a[0];
+    d2 = a[2] - a[0];
+    plane[0] = (d1*y2 - d2*y1) / area;
+    plane[1] = (d2*x1 - d1*x2) / area;
+    plane[2] = a[0] - plane[0]*rec->p[0].x - plane[1]*rec->p[0].y;
+}
+
+//Work out the screen space planes of u/w, v/w and 1/w for lane i of the
+//pending batch, which setup has put out in out, and pick the mip level whose
+//texels come closest to one per pixel over the whole triangle. Returns zero
+//if the triangle has no area on the screen
+int setup_texture(tri_setup *rec, setup_result *out, int i) {
+    
+    int j, k, level;
+    double a[3][3], area, tw, th, texel_area;
+    texture *tex = pending.tex[i];
+    
+    if(!(area = setup_plane_area(rec)))
+        return 0;
+        
+    //Clip space z is the w that the divide happens by
+    for(j = 0; j < 3; j++) {
+        
+        k = out->order[j][i];
+        a[2][j] = 1.0 / pending.z[k][i];
+        a[0][j] = pending.u[k][i] * a[2][j];
+        a[1][j] = pending.v[k][i] * a[2][j];
+    }
+    
+    for(j = 0; j < 3; j++)
+        setup_plane(rec, area, a[j], rec->tex_plane[j]);
+    
+    //Each level down has a quarter of the texels, so step down until
+    //there's no more than one to a pixel
+    tw = 1 << tex->w_shift[0];
+    th = 1 << tex->h_shift[0];
+    k = out->order[0][i];
+    j = out->order[1][i];
+    level = out->order[2][i];
+    texel_area = fabs(((pending.u[j][i] - pending.u[k][i]) * (pending.v[level][i] - pending.v[k][i]) -
+                       (pending.u[level][i] - pending.u[k][i]) * (pending.v[j][i] - pending.v[k][i])) * tw * th);
+    
+    for(level = 0; level < tex->levels - 1 && texel_area > fabs(area); level++)
+        texel_area /= 4;
+        
+    rec->mip = level;
+    rec->light = (int)(out->light[i] * 256);
+    
+    return 1;
+}
+
+//Fit planes to the lit vertex colors of lane i of the pending batch, clamped
+//and taken in the setup's sorted vertex order, which both the rasterizers and
+//the visibility buffer shade from
+void setup_gouraud(tri_setup *rec, setup_result *out, int i) {
+    
+    int j, k;
+    double a[3][3], area;
+    
+    for(j = 0; j < 3; j++) {
+        
+        k = out->order[j][i];
+        a[0][j] = pending.vr[k][i] > 255.0 ? 255 : pending.vr[k][i] < 0 ? 0 : pending.vr[k][i];
+        a[1][j] = pending.vg[k][i] > 255.0 ? 255 : pending.vg[k][i] < 0 ? 0 : pending.vg[k][i];
+        a[2][j] = pending.vb[k][i] > 255.0 ? 255 : pending.vb[k][i] < 0 ? 0 : pending.vb[k][i];
+    }
+    
+    area = setup_plane_area(rec);
+        
+    for(k = 0; k < 3; k++) {
+        
+        //A triangle without any area can still cover a line of pixels, which
+        //just take the first vertex's color
+        if(area) {
+            
+            setup_plane(rec, area, a[k], rec->color_plane[k]);
+        } else {
+            
+            rec->color_plane[k][0] = rec->color_plane[k][1] = 0;
+            rec->color_plane[k][2] = a[k][0];
+        }
+    }
+}
+
+//Give a setup the next triangle id. Returns zero if there wasn't room
+int add_vis_setup(tri_setup *rec) {
+    
+    tri_setup **grown;
+    int new_cap;
+    
+    if(vis_count == vis_cap) {
+        
+        new_cap = vis_cap ? vis_cap * 2 : 1024;
+        
+        if(!(grown = (tri_setup**)realloc(vis_setups, new_cap * sizeof(tri_setup*))))
+            return 0;
+            
+        vis_setups = grown;
+        vis_cap = new_cap;
+    }
+    
+    vis_setups[vis_count++] = rec;
+    
+    return 1;
+}
+
+//Run the pending batch through setup and bin whatever survives it
+void flush_setup_batch() {
+    
+    int i, j;
+    setup_result out;
+    tri_setup temp, *rec = &temp, *stored;
+    surface_entry *entry;
+    
+    if(!pending.count)
+        return;
+        
+    //Lanes past the end of a short batch are zeroed so that setup has
+    //something harmless to work on there
+    for(i = pending.count; i < SETUP_BATCH; i++) {
+        
+        for(j = 0; j < 3; j++) {
+            
+            pending.z[j][i] = 0;
+            pending.px[j][i] = pending.py[j][i] = pending.pz[j][i] = 0;
+            pending.u[j][i] = pending.v[j][i] = 0;
+            pending.vr[j][i] = pending.vg[j][i] = pending.vb[j][i] = 0;
+        }
+            
+        pending.r[i] = pending.g[i] = pending.b[i] = pending.nz[i] = 0;
+        pending.tex[i] = NULL;
+        pending.surface[i] = -1;
+    }
+        
+    setup_lanes(&pending, &out);
+    
+    for(i = 0; i < pending.count; i++) {
+        
+        if(!out.keep[i])
+            continue;
+            
+        for(j = 0; j < 3; j++) {
+            
+            rec->p[j].x = out.x[j][i];
+            rec->p[j].y = out.y[j][i];
+            rec->p[j].z = (unsigned short)out.z[j][i];
+        }
+        
+        //Bounding box, clipped to the scissor. Y is already in order
+        rec->bounds.x0 = rec->p[0].x < rec->p[1].x ? (rec->p[0].x < rec->p[2].x ? rec->p[0].x : rec->p[2].x) : (rec->p[1].x < rec->p[2].x ? rec->p[1].x : rec->p[2].x);
+        rec->bounds.x1 = rec->p[0].x > rec->p[1].x ? (rec->p[0].x > rec->p[2].x ? rec->p[0].x : rec->p[2].x) : (rec->p[1].x > rec->p[2].x ? rec->p[1].x : rec->p[2].x);
+        rec->bounds.y0 = rec->p[0].y;
+        rec->bounds.y1 = rec->p[2].y;
+        
+        if(rec->bounds.x1 < scissor.x0 || rec->bounds.y1 < scissor.y0 || rec->bounds.x0 > scissor.x1 || rec->bounds.y0 > scissor.y1)
+            continue;
+        
+        rec->bounds.x0 = rec->bounds.x0 < scissor.x0 ? scissor.x0 : rec->bounds.x0;
+        rec->bounds.y0 = rec->bounds.y0 < scissor.y0 ? scissor.y0 : rec->bounds.y0;
+        rec->bounds.x1 = rec->bounds.x1 > scissor.x1 ? scissor.x1 : rec->bounds.x1;
+        rec->bounds.y1 = rec->bounds.y1 > scissor.y1 ? scissor.y1 : rec->bounds.y1;
+        rec->pixel = rec->shade = out.pixel[i];
+        rec->span_buffered = static_geometry && hsr_mode == HSR_SPANS;
+        rec->near_z = rec->p[0].z < rec->p[1].z ? (rec->p[0].z < rec->p[2].z ? rec->p[0].z : rec->p[2].z) : (rec->p[1].z < rec->p[2].z ? rec->p[1].z : rec->p[2].z);
+        rec->far_z = rec->p[0].z > rec->p[1].z ? (rec->p[0].z > rec->p[2].z ? rec->p[0].z : rec->p[2].z) : (rec->p[1].z > rec->p[2].z ? rec->p[1].z : rec->p[2].z);
+        rec->tex = pending.tex[i] && setup_texture(rec, &out, i) ? pending.tex[i] : NULL;
+        rec->textured = rec->tex != NULL;
+        
+        //Environment surfaces are drawn from lit copies out of the surface
+        //cache, and anything that doesn't fit is lit as it's drawn
+        if(rec->tex && pending.surface[i] >= 0) {
+            
+            rec->light = (rec->light + SURFACE_LIGHT_STEP / 2) / SURFACE_LIGHT_STEP * SURFACE_LIGHT_STEP;
+            rec->light = rec->light > 256 ? 256 : rec->light;
+            entry = cache_surface(pending.surface[i], rec->tex, rec->mip, rec->light);
+        } else {
+            
+            entry = NULL;
+        }
+        
+        rec->lit = entry != NULL;
+        rec->texels = entry ? entry->texels : rec->tex ? rec->tex->texels[rec->mip] : NULL;
+        
+        //Textured triangles keep to the light of the whole face
+        rec->smooth = rec->gouraud = light_mode == LIGHT_GOURAUD && !rec->tex;
+        
+        if(rec->smooth)
+            setup_gouraud(rec, &out, i);
+        
+        if(!(stored = arena_new(&frame_arena, tri_setup))) {
+            
+            printf("[flush_setup_batch] failed to allocate setup\n");
+            break;
+        }
+        
+        *stored = *rec;
+        
+        //Without room for its id the triangle just gets drawn forward.
+        //Textured and Gouraud shaded ones get their texels looked up or their
+        //colors worked out in the resolve instead
+        if(shade_mode == SHADE_DEFERRED && add_vis_setup(stored)) {
+            
+            stored->pixel = vis_count - 1;
+            stored->textured = 0;
+            stored->gouraud = 0;
+        }
+            
+        bin_setup(stored);
+        binned_count++;
+    }
+    
+    pending.count = 0;
+}
+
+//Queue a triangle up for setup, which happens a batch at a time. p holds
+//its vertices already projected to the screen. Nothing gets drawn until
+//render_bins
+void setup_triangle(triangle* tri, screen_point* p) {
+    
+    int i = pending.count, j;
+    
+    for(j = 0; j < 3; j++) {
+        
+        pending.z[j][i] = tri->v[j].z;
+        pending.px[j][i] = p[j].x;
+        pending.py[j][i] = p[j].y;
+        pending.pz[j][i] = p[j].z;
+        pending.u[j][i] = tri->v[j].u;
+        pending.v[j][i] = tri->v[j].v;
+        pending.vr[j][i] = tri->v[j].r;
+        pending.vg[j][i] = tri->v[j].g;
+        pending.vb[j][i] = tri->v[j].b;
+    }
+    
+    //The shading color is based on the first vertex color
+    pending.r[i] = tri->v[0].c->r;
+    pending.g[i] = tri->v[0].c->g;
+    pending.b[i] = tri->v[0].c->b;
+    pending.nz[i] = tri->nz;
+    pending.tex[i] = tri->tex;
+    pending.surface[i] = tri->surface;
+    
+    if(++pending.count == SETUP_BATCH)
+        flush_setup_batch();
+}
+
+//Mark what gets set up from here on as static scenery or not. Whatever is
+//still waiting on setup goes through first as it was
+void set_static_geometry(int on) {
+    
+    flush_setup_batch();
+    static_geometry = on;
+}
+
+//Change the scissor. Whatever is still waiting on setup was queued under the
+//old one, so it goes through first
+void set_scissor(rect *r) {
+    
+    flush_setup_batch();
+    scissor = *r;
+}
+
+//Work out where a triangle's edges cross a row and set up stepping them on
+//from there
+void start_active_tri(active_tri *e, int row) {
+    
+    screen_point *p = e->rec->p;
+    
+    start_edge(&(e->long_edge), &p[0], &p[2], row);
+    
+    if(row < e->mid)
+        start_edge(&(e->short_edge), &p[0], &p[1], row);
+    else
+        start_edge(&(e->short_edge), &p[1], &p[2], row);
+}
+
+//Tighten the hierarchical z of the tiles in one band of a bin to exactly the
+//farthest depth in each. The band has only just been drawn so this reads
+//straight out of the cache
+void refit_band_zmax(rect *clip, int band) {
+    
+    int tx, tile, y, x, addr;
+    unsigned short zmax;
+    
+    for(tx = clip->x0 / BLOCK_SIZE; tx <= clip->x1 / BLOCK_SIZE; tx++) {
+        
+        tile = band * TILES_X + tx;
+        
+        if(tile_epoch[tile] != frame_epoch)
+            continue;
+            
+        zmax = 0;
+        addr = band * BLOCK_SIZE * SCREEN_WIDTH + tx * BLOCK_SIZE;
+        
+        for(y = 0; y < BLOCK_SIZE; y++, addr += SCREEN_WIDTH)
+            for(x = 0; x < BLOCK_SIZE; x++)
+                zmax = zbuf[addr + x] > zmax ? zbuf[addr + x] : zmax;
+                
+        tile_zmax[tile] = zmax;
+    }
+}
+
+//Draw a whole bin a scanline at a time rather than a triangle at a time. The
+//bin's triangles are first sorted into an edge table by the row they start
+//on, then the rows are swept top to bottom with an active edge table of the
+//triangles crossing the current one, so that every span on a row is drawn
+//while that row's depth and color are in the cache. The active table is kept
+//in submission order so that front to back ordering still holds on each row
+void raster_bin_edge_table(int index, rect *clip) {
+    
+    int i, n = 0, row, band;
+    active_tri *first[BIN_SIZE], *last[BIN_SIZE], *active = NULL, *e, **link, *add;
+    bin_chunk *chunk;
+    tri_setup *rec;
+    rect *a;
+    
+    for(i = 0; i < BIN_SIZE; i++)
+        first[i] = last[i] = NULL;
+        
+    for(chunk = bins[index].first; chunk; chunk = chunk->next) {
+        
+        for(i = 0; i < chunk->count; i++) {
+            
+            rec = chunk->items[i];
+            e = &(bins[index].pool[n]);
+            a = &(e->area);
+            a->x0 = rec->bounds.x0 < clip->x0 ? clip->x0 : rec->bounds.x0;
+            a->y0 = rec->bounds.y0 < clip->y0 ? clip->y0 : rec->bounds.y0;
+            a->x1 = rec->bounds.x1 > clip->x1 ? clip->x1 : rec->bounds.x1;
+            a->y1 = rec->bounds.y1 > clip->y1 ? clip->y1 : rec->bounds.y1;
+            
+            //Rows are drawn up to but not including the bottom vertex's
+            e->end = rec->p[2].y < a->y1 + 1 ? rec->p[2].y : a->y1 + 1;
+            
+            if(a->x0 > a->x1 || a->y0 >= e->end)
+                continue;
+                
+            e->rec = rec;
+            e->order = n++;
+            e->mid = rec->p[1].y;
+            e->next = NULL;
+            row = a->y0 - clip->y0;
+            
+            if(last[row])
+                last[row]->next = e;
+            else
+                first[row] = e;
+                
+            last[row] = e;
+        }
+    }
+    
+    for(row = clip->y0; row <= clip->y1; row++) {
+        
+        //Merge the triangles starting here into the active table. Both lists
+        //are already in submission order. Anything the hierarchical z says is
+        //hidden by the rows drawn so far never goes in
+        link = &active;
+        
+        for(add = first[row - clip->y0]; add; add = e) {
+            
+            e = add->next;
+            a = &(add->area);
+            
+            if(hiz_tiles_hidden(a->x0 / BLOCK_SIZE, a->y0 / BLOCK_SIZE, a->x1 / BLOCK_SIZE, a->y1 / BLOCK_SIZE, add->rec->near_z))
+                continue;
+                
+            start_active_tri(add, row);
+            
+            while(*link && (*link)->order < add->order)
+                link = &((*link)->next);
+                
+            add->next = *link;
+            *link = add;
+        }
+        
+        //The depth a triangle's coverage of a tile would tighten the
+        //hierarchical z to gets worked out exactly once the band is done,
+        //so the spans don't track it
+        for(link = &active; (e = *link); ) {
+            
+            if(e->rec->span_buffered)
+                draw_scanline_spans(e->rec, 65535, &(e->area), row, e->short_edge.value, e->long_edge.value);
+            else
+                draw_scanline(e->rec, 65535, &(e->area), row, e->short_edge.value, e->long_edge.value);
+                
+            if(row + 1 >= e->end) {
+                
+                *link = e->next;
+                continue;
+            }
+            
+            interp_step(&(e->long_edge));
+            
+            if(row + 1 == e->mid)
+                start_edge(&(e->short_edge), &(e->rec->p[1]), &(e->rec->p[2]), row + 1);
+            else
+                interp_step(&(e->short_edge));
+            
+            link = &(e->next);
+        }
+        
+        band = row / BLOCK_SIZE;
+        
+        if(row == clip->y1 || (row + 1) % BLOCK_SIZE == 0)
+            refit_band_zmax(clip, band);
+    }
+}
+
+void raster_bin(int index) {
+    
+    int i;
+    rect clip;
+    bin_chunk *chunk;
+    
+    clip.x0 = (index % BINS_X) * BIN_SIZE;
+    clip.y0 = (index / BINS_X) * BIN_SIZE;
+    clip.x1 = clip.x0 + BIN_SIZE - 1;
+    clip.y1 = clip.y0 + BIN_SIZE - 1;
+    clip.x1 = clip.x1 >= SCREEN_WIDTH ? SCREEN_WIDTH - 1 : clip.x1;
+    clip.y1 = clip.y1 >= SCREEN_HEIGHT ? SCREEN_HEIGHT - 1 : clip.y1;
+    
+    if(raster_mode == RASTER_EDGE_TABLE && bins[index].pool) {
+        
+        raster_bin_edge_table(index, &clip);
+        return;
+    }
+    
+    for(chunk = bins[index].first; chunk; chunk = chunk->next)
+        for(i = 0; i < chunk->count; i++)
+            raster_triangle(chunk->items[i], &clip);
+}
+
+//Keep pulling bins off the shared counter until there are none left. Bins
+//don't share any pixels or tiles, so nothing here needs a lock
+void raster_bins() {
+    
+    int index;
+    
+    while((index = SDL_AtomicAdd(&next_bin, 1)) < BIN_COUNT)
+        raster_bin(index);
+}
+
+int worker_main(void *data) {
+    
+    (void)data;
+    
+    while(1) {
+        
+        SDL_SemWait(work_start);
+        
+        if(workers_quit)
+            break;
+            
+        raster_bins();
+        SDL_SemPost(work_done);
+    }
+    
+    return 0;
+}
+
+int init_workers() {
+    
+    int i;
+    
+    worker_count = SDL_GetCPUCount() - 1;
+    worker_count = worker_count < 0 ? 0 : worker_count > MAX_WORKERS ? MAX_WORKERS : worker_count;
+    
+    if(!(work_start = SDL_CreateSemaphore(0)) || !(work_done = SDL_CreateSemaphore(0)))
+        return 0;
+    
+    for(i = 0; i < worker_count; i++) {
+        
+        if(!(workers[i] = SDL_CreateThread(worker_main, "raster", NULL))) {
+            
+            //Carry on with however many we did manage to start
+            printf("[init_workers] could not start worker #%d: %s\n", i+1, SDL_GetError());
+            worker_count = i;
+            break;
+        }
+    }
+    
+    printf("Rasterizing with %d threads\n", worker_count + 1);
+    
+    return 1;
+}
+
+void shutdown_workers() {
+    
+    int i;
+    
+    workers_quit = 1;
+    
+    for(i = 0; i < worker_count; i++)
+        SDL_SemPost(work_start);
+        
+    for(i = 0; i < worker_count; i++)
+        SDL_WaitThread(workers[i], NULL);
+}
+
+//Draw everything that's been binned this frame across all of the threads,
+//then empty the bins out for the next one
+void render_bins() {
+    
+    int i;
+    
+    flush_setup_batch();
+    
+    //Threads can't allocate from the frame arena, so the edge table engine's
+    //records are handed out to the bins beforehand. A bin that doesn't get
+    //any is drawn a triangle at a time instead
+    if(raster_mode == RASTER_EDGE_TABLE)
+        for(i = 0; i < BIN_COUNT; i++)
+            if(bins[i].count && !(bins[i].pool = (active_tri*)arena_alloc(&frame_arena, bins[i].count * sizeof(active_tri))))
+                printf("[render_bins] failed to allocate edge table\n");
+                
+    SDL_AtomicSet(&next_bin, 0);
+    
+    for(i = 0; i < worker_count; i++)
+        SDL_SemPost(work_start);
+        
+    raster_bins();
+    
+    for(i = 0; i < worker_count; i++)
+        SDL_SemWait(work_done);
+        
+    //The chunks themselves go with the frame arena
+    for(i = 0; i < BIN_COUNT; i++) {
+        
+        bins[i].first = bins[i].last = NULL;
+        bins[i].count = 0;
+        bins[i].pool = NULL;
+    }
+        
+    binned_count = 0;
+}
+
+//Work out which frustum planes and guard band planes a clip space vertex is
+//outside of. The screen spans -w to w vertically and the aspect ratio times
+//that horizontally
+unsigned short compute_outcode(vertex *v) {
+    
+    float wx = v->z * SCREEN_WIDTH / SCREEN_HEIGHT, wy = v->z;
+    
+    return (v->z < NEAR_Z ? OUT_NEAR : 0) | (v->z > SCREEN_DEPTH ? OUT_FAR : 0) |
+           (v->x < -wx ? OUT_LEFT : 0) | (v->x > wx ? OUT_RIGHT : 0) |
+           (v->y < -wy ? OUT_BOTTOM : 0) | (v->y > wy ? OUT_TOP : 0) |
+           (v->x < -GUARD_BAND*wx ? GUARD_LEFT : 0) | (v->x > GUARD_BAND*wx ? GUARD_RIGHT : 0) |
+           (v->y < -GUARD_BAND*wy ? GUARD_BOTTOM : 0) | (v->y > GUARD_BAND*wy ? GUARD_TOP : 0);
+}
+
+//Clip a triangle to each of the planes in the planes mask in turn as a
+//polygon, bouncing it between two fixed buffers, then queue up whatever is
+//left for setup as a fan of triangles
+void clip_and_render(triangle* tri, int planes) {    
+
+    clip_vertex poly[2][CLIP_MAX_VERTS], *in = poly[0], *out = poly[1], *swap, *from, *to;
+    float d[CLIP_MAX_VERTS], t;
+    int count = 3, out_count, i, j, k, n;
+    screen_point p[CLIP_MAX_VERTS], fan_p[3];
+    triangle fan;
+    clip_plane *plane;
+    
+    for(i = 0; i < 3; i++) {
+        
+        in[i].a[ATTR_X] = tri->v[i].x;
+        in[i].a[ATTR_Y] = tri->v[i].y;
+        in[i].a[ATTR_Z] = tri->v[i].z;
+        in[i].a[ATTR_U] = tri->v[i].u;
+        in[i].a[ATTR_V] = tri->v[i].v;
+        in[i].a[ATTR_R] = tri->v[i].r;
+        in[i].a[ATTR_G] = tri->v[i].g;
+        in[i].a[ATTR_B] = tri->v[i].b;
+    }
+    
+    for(k = 0; k < CLIP_PLANE_COUNT; k++) {
+        
+        plane = &clip_planes[k];
+        
+        if(!(planes & plane->bit))
+            continue;
+            
+        for(i = 0; i < count; i++)
+            d[i] = plane->a*in[i].a[ATTR_X] + plane->b*in[i].a[ATTR_Y] + plane->c*in[i].a[ATTR_Z] + plane->d;
+            
+        //Walk the edges, keeping the vertices on the inside and adding one
+        //wherever an edge crosses the plane. Crossings are always measured
+        //from the inside end so that the two triangles sharing an edge get
+        //exactly the same new vertex
+        out_count = 0;
+        
+        for(i = 0, j = count - 1; i < count; j = i++) {
+            
+            if((d[i] >= 0) != (d[j] >= 0)) {
+                
+                from = d[j] >= 0 ? &in[j] : &in[i];
+                to = d[j] >= 0 ? &in[i] : &in[j];
+                t = d[j] >= 0 ? d[j] / (d[j] - d[i]) : d[i] / (d[i] - d[j]);
+                
+                for(n = 0; n < CLIP_ATTRS; n++)
+                    out[out_count].a[n] = from->a[n] + t * (to->a[n] - from->a[n]);
+                    
+                out_count++;
+            }
+            
+            if(d[i] >= 0)
+                out[out_count++] = in[i];
+        }
+        
+        //Nothing, or nothing with any area, is left
+        if(out_count < 3)
+            return;
+            
+        swap = in;
+        in = out;
+        out = swap;
+        count = out_count;
+    }
+    
+    //If we got this far, what's left is drawable. Each vertex only gets
+    //projected once however many triangles of the fan it ends up in
+    for(i = 0; i < count; i++) {
+        
+        fan.v[0].x = in[i].a[ATTR_X];
+        fan.v[0].y = in[i].a[ATTR_Y];
+        fan.v[0].z = in[i].a[ATTR_Z];
+        project(&(fan.v[0]), &p[i]);
+    }
+    
+    //The whole fan keeps the base color, texture, surface and normal of the
+    //triangle it was cut from. Lit colors were clipped like everything else
+    fan.v[0].c = fan.v[1].c = fan.v[2].c = tri->v[0].c;
+    fan.tex = tri->tex;
+    fan.surface = tri->surface;
+    fan.nx = tri->nx;
+    fan.ny = tri->ny;
+    fan.nz = tri->nz;
+    
+    for(i = 1; i < count - 1; i++) {
+        
+        for(j = 0; j < 3; j++) {
+            
+            n = j ? i + j - 1 : 0;
+            fan.v[j].x = in[n].a[ATTR_X];
+            fan.v[j].y = in[n].a[ATTR_Y];
+            fan.v[j].z = in[n].a[ATTR_Z];
+            fan.v[j].u = in[n].a[ATTR_U];
+            fan.v[j].v = in[n].a[ATTR_V];
+            fan.v[j].r = in[n].a[ATTR_R];
+            fan.v[j].g = in[n].a[ATTR_G];
+            fan.v[j].b = in[n].a[ATTR_B];
+            fan_p[j] = p[n];
+        }
+        
+        setup_triangle(&fan, fan_p);
+    }
+}
+
+//Draw a single triangle that's already in clip space
+void render_triangle(triangle* tri) {
+
+    int i, clip;
+    unsigned short outcode[3];
+    screen_point p[3];
+    
+    for(i = 0; i < 3; i++)
+        outcode[i] = compute_outcode(&(tri->v[i]));
+        
+    if(outcode[0] & outcode[1] & outcode[2] & OUT_REJECT)
+        return;
+        
+    clip = (outcode[0] | outcode[1] | outcode[2]) & OUT_CLIP;
+    
+    if(clip) {
+        
+        clip_and_render(tri, clip);
+        return;
+    }
+    
+    for(i = 0; i < 3; i++)
+        project(&(tri->v[i]), &p[i]);
+        
+    setup_triangle(tri, p);
+}
+
+//Work out a vertex's lit color from its color and its normal's z in view or
+//clip space, with the same light that setup gives whole faces
+void light_vertex(vertex *v) {
+    
+    float light = LIGHT_FROM_COS(-v->nz);
+    
+    v->r = v->c->r * light;
+    v->g = v->c->g * light;
+    v->b = v->c->b * light;
+}
+
+//Look up a mesh vertex in the post-transform cache, taking it to clip space,
+//lighting it, classifying it against the frustum and projecting it the first
+//time any face asks for it. Vertices that will have to be clipped away don't get projected
+xvertex *fetch_vertex(object *obj, matrix *mvp, int index) {
+    
+    xvertex *xv = &(obj->xform[index]);
+    
+    if(xv->stamp == obj->xform_stamp)
+        return xv;
+        
+    transform_vertex(mvp, &(obj->verts[index]), &(xv->v));
+    light_vertex(&(xv->v));
+    xv->outcode = compute_outcode(&(xv->v));
+    
+    if(!(xv->outcode & OUT_CLIP))
+        project(&(xv->v), &(xv->p));
+        
+    xv->stamp = obj->xform_stamp;
+    
+    return xv;
+}
+
+//Send an object's faces down the pipeline, leaving the mesh itself as it was
+//built. Faces entirely outside one plane of the frustum are dropped outright,
+//and only the ones reaching past the near or far plane or the guard band go
+//through the clipper
+void submit_object(object *obj, camera *cam) {
+    
+    int i, j, clip;
+    float inv_f2 = 1.0 / (focal_length * focal_length);
+    matrix mvp;
+    face *f;
+    xvertex *xv[3];
+    triangle tri;
+    screen_point p[3];
+    
+    matrix_multiply(&(cam->view_proj), &(obj->model), &mvp);
+    
+    //Bumping the stamp invalidates every cached vertex at once. Zero is what
+    //add_vertex marks entries with, so it's never used
+    if(!++obj->xform_stamp)
+        obj->xform_stamp = 1;
+    
+    for(i = 0; i < obj->face_count; i++) {
+        
+        f = &(obj->faces[i]);
+        
+        for(j = 0; j < 3; j++)
+            xv[j] = fetch_vertex(obj, &mvp, f->v[j]);
+            
+        if(xv[0]->outcode & xv[1]->outcode & xv[2]->outcode & OUT_REJECT)
+            continue;
+            
+        //A face is facing away when its normal points the same way as the
+        //line from the camera to any point on it. Both are in clip space,
+        //which has taken the x and y of each up by the focal length
+        transform_normal(&mvp, f->nx, f->ny, f->nz, &(tri.nx), &(tri.ny), &(tri.nz));
+        
+        if((tri.nx*xv[0]->v.x + tri.ny*xv[0]->v.y) * inv_f2 + tri.nz*xv[0]->v.z >= 0)
+            continue;
+            
+        //Texture coordinates belong to the face corner rather than the
+        //shared vertex, so they go in after the cached transform
+        for(j = 0; j < 3; j++) {
+            
+            tri.v[j] = xv[j]->v;
+            tri.v[j].u = f->uv[j][0];
+            tri.v[j].v = f->uv[j][1];
+            p[j] = xv[j]->p;
+        }
+        
+        tri.tex = obj->tex;
+        tri.surface = -1;
+        
+        //Only the planes some vertex is actually out past need clipping to
+        clip = (xv[0]->outcode | xv[1]->outcode | xv[2]->outcode) & OUT_CLIP;
+        
+        if(clip)
+            clip_and_render(&tri, clip);
+        else
+            setup_triangle(&tri, p);
+    }
+}
+
+//Draw an object on its own, skipping it as a whole when its bounds are
+//entirely outside the view
+void render_object(object *obj, camera *cam) {
+    
+    if(sphere_in_frustum(cam, &(obj->world_sphere)) == FRUSTUM_OUTSIDE ||
+       box_in_frustum(cam, &(obj->world_bounds)) == FRUSTUM_OUTSIDE)
+        return;
+        
+    submit_object(obj, cam);
+}
+
+void box_union(box *a, box *b, box *out) {
+    
+    int i;
+    
+    for(i = 0; i < 3; i++) {
+        
+        out->min[i] = a->min[i] < b->min[i] ? a->min[i] : b->min[i];
+        out->max[i] = a->max[i] > b->max[i] ? a->max[i] : b->max[i];
+    }
+}
+
+int box_overlap(box *a, box *b) {
+    
+    int i;
+    
+    for(i = 0; i < 3; i++)
+        if(a->min[i] > b->max[i] || b->min[i] > a->max[i])
+            return 0;
+            
+    return 1;
+}
+
+void init_scene(scene *scn) {
+    
+    scn->objects = NULL;
+    scn->object_count = scn->object_cap = 0;
+    scn->order = NULL;
+    scn->nodes = NULL;
+    scn->node_count = 0;
+}
+
+void free_scene(scene *scn) {
+    
+    free(scn->objects);
+    free(scn->order);
+    free(scn->nodes);
+    init_scene(scn);
+}
+
+//Returns zero if the object couldn't be added
+int add_to_scene(scene *scn, object *obj) {
+    
+    object **grown;
+    int new_cap;
+    
+    if(scn->object_count == scn->object_cap) {
+        
+        new_cap = scn->object_cap ? scn->object_cap * 2 : 64;
+        
+        if(!(grown = (object**)realloc(scn->objects, new_cap * sizeof(object*))))
+            return 0;
+            
+        scn->objects = grown;
+        scn->object_cap = new_cap;
+    }
+    
+    scn->objects[scn->object_count++] = obj;
+    
+    //The hierarchy no longer covers everything, so it gets built again
+    scn->node_count = 0;
+    
+    return 1;
+}
+
+//qsort has no way to pass these along to the comparison
+scene *bvh_sort_scene;
+int bvh_sort_axis;
+
+int bvh_compare(const void *a, const void *b) {
+    
+    box *ba = &(bvh_sort_scene->objects[*(const int*)a]->world_bounds);
+    box *bb = &(bvh_sort_scene->objects[*(const int*)b]->world_bounds);
+    float ca = ba->min[bvh_sort_axis] + ba->max[bvh_sort_axis];
+    float cb = bb->min[bvh_sort_axis] + bb->max[bvh_sort_axis];
+    
+    return ca < cb ? -1 : ca > cb ? 1 : 0;
+}
+
+//Build the subtree over order[first] to order[first + count - 1] by splitting
+//at the median along whichever axis their centers are most spread out on, and
+//return the index of its root
+int build_bvh_node(scene *scn, int first, int count) {
+    
+    int index = scn->node_count++, i, axis;
+    bvh_node *node = &(scn->nodes[index]);
+    box centers;
+    float c, spread;
+    
+    node->bounds = scn->objects[scn->order[first]]->world_bounds;
+    
+    for(i = 0; i < 3; i++)
+        centers.min[i] = centers.max[i] = node->bounds.min[i] + node->bounds.max[i];
+    
+    for(i = first + 1; i < first + count; i++) {
+        
+        box_union(&(node->bounds), &(scn->objects[scn->order[i]]->world_bounds), &(node->bounds));
+        
+        for(axis = 0; axis < 3; axis++) {
+            
+            c = scn->objects[scn->order[i]]->world_bounds.min[axis] + scn->objects[scn->order[i]]->world_bounds.max[axis];
+            centers.min[axis] = c < centers.min[axis] ? c : centers.min[axis];
+            centers.max[axis] = c > centers.max[axis] ? c : centers.max[axis];
+        }
+    }
+    
+    for(axis = 0, i = 1; i < 3; i++)
+        if(centers.max[i] - centers.min[i] > centers.max[axis] - centers.min[axis])
+            axis = i;
+            
+    spread = centers.max[axis] - centers.min[axis];
+    
+    //Objects all sitting on the same spot can't be split up either
+    if(count <= BVH_LEAF_SIZE || spread <= 0) {
+        
+        node->left = node->right = -1;
+        node->first = first;
+        node->count = count;
+        
+        return index;
+    }
+    
+    bvh_sort_scene = scn;
+    bvh_sort_axis = axis;
+    qsort(&(scn->order[first]), count, sizeof(int), bvh_compare);
+    
+    node->first = node->count = 0;
+    i = build_bvh_node(scn, first, count / 2);
+    node = &(scn->nodes[index]);
+    node->left = i;
+    i = build_bvh_node(scn, first + count / 2, count - count / 2);
+    node = &(scn->nodes[index]);
+    node->right = i;
+    
+    return index;
+}
+
+//Returns zero if there wasn't the memory for it
+int build_bvh(scene *scn) {
+    
+    int i, *grown_order;
+    bvh_node *grown_nodes;
+    
+    scn->node_count = 0;
+    
+    if(!scn->object_count)
+        return 1;
+        
+    if(!(grown_order = (int*)realloc(scn->order, scn->object_count * sizeof(int))))
+        return 0;
+        
+    scn->order = grown_order;
+    
+    //A binary tree with n leaves has 2n - 1 nodes, and there are never more
+    //leaves than objects
+    if(!(grown_nodes = (bvh_node*)realloc(scn->nodes, (2 * scn->object_count - 1) * sizeof(bvh_node))))
+        return 0;
+        
+    scn->nodes = grown_nodes;
+    
+    for(i = 0; i < scn->object_count; i++)
+        scn->order[i] = i;
+        
+    build_bvh_node(scn, 0, scn->object_count);
+    
+    return 1;
+}
+
+//Bring the hierarchy's bounds up to date with where the objects are now
+//without changing its shape. Children always come after their parents, so
+//going backwards means they're done by the time their parent is
+void refit_bvh(scene *scn) {
+    
+    int i, j;
+    bvh_node *node;
+    
+    for(i = scn->node_count - 1; i >= 0; i--) {
+        
+        node = &(scn->nodes[i]);
+        
+        if(node->count) {
+            
+            node->bounds = scn->objects[scn->order[node->first]]->world_bounds;
+            
+            for(j = node->first + 1; j < node->first + node->count; j++)
+                box_union(&(node->bounds), &(scn->objects[scn->order[j]]->world_bounds), &(node->bounds));
+        } else {
+            
+            box_union(&(scn->nodes[node->left].bounds), &(scn->nodes[node->right].bounds), &(node->bounds));
+        }
+    }
+}
+
+//Whether everything already drawn this frame is definitely in front of all of
+//a box. That's when the hierarchical z says the box's nearest point is behind
+//every tile its screen rectangle touches. Boxes reaching in front of the near
+//plane can't be projected, so they're never called hidden
+int box_occluded(camera *cam, box *b) {
+    
+    int i, tx0, ty0, tx1, ty1;
+    vertex corner, clip;
+    screen_point p;
+    float near_z = SCREEN_DEPTH;
+    int x0 = SCREEN_WIDTH, y0 = SCREEN_HEIGHT, x1 = -1, y1 = -1;
+    
+    for(i = 0; i < 8; i++) {
+        
+        corner.x = i & 1 ? b->max[0] : b->min[0];
+        corner.y = i & 2 ? b->max[1] : b->min[1];
+        corner.z = i & 4 ? b->max[2] : b->min[2];
+        corner.c = NULL;
+        transform_vertex(&(cam->view_proj), &corner, &clip);
+        
+        if(clip.z < NEAR_Z)
+            return 0;
+            
+        project(&clip, &p);
+        near_z = clip.z < near_z ? clip.z : near_z;
+        x0 = p.x < x0 ? p.x : x0;
+        y0 = p.y < y0 ? p.y : y0;
+        x1 = p.x > x1 ? p.x : x1;
+        y1 = p.y > y1 ? p.y : y1;
+    }
+    
+    tx0 = x0 < 0 ? 0 : x0 / BLOCK_SIZE;
+    ty0 = y0 < 0 ? 0 : y0 / BLOCK_SIZE;
+    tx1 = x1 >= SCREEN_WIDTH ? TILES_X - 1 : x1 / BLOCK_SIZE;
+    ty1 = y1 >= SCREEN_HEIGHT ? TILES_Y - 1 : y1 / BLOCK_SIZE;
+    
+    if(tx1 < tx0 || ty1 < ty0)
+        return 0;
+        
+    return hiz_tiles_hidden(tx0, ty0, tx1, ty1, TO_SCREEN_Z(near_z));
+}
+
+//Squared distance from the camera to the middle of a box
+float box_distance2(camera *cam, box *b) {
+    
+    float dx = (b->min[0] + b->max[0]) / 2.0 - cam->x;
+    float dy = (b->min[1] + b->max[1]) / 2.0 - cam->y;
+    float dz = (b->min[2] + b->max[2]) / 2.0 - cam->z;
+    
+    return dx*dx + dy*dy + dz*dz;
+}
+
+//Draw everything in the scene the camera might be able to see. The hierarchy
+//is walked nearest child first, dropping whole subtrees that are outside the
+//frustum or behind what's been drawn so far, and subtrees found to be wholly
+//inside the frustum aren't tested against it again
+void render_scene(scene *scn, camera *cam) {
+    
+    int stack_node[BVH_STACK], stack_state[BVH_STACK];
+    int top = 0, index, state, i, near_child, far_child;
+    bvh_node *node;
+    object *obj;
+    
+    if(!scn->object_count)
+        return;
+    
+    if(!scn->node_count) {
+        
+        if(!build_bvh(scn)) {
+            
+            printf("[render_scene] failed to build the scene hierarchy\n");
+            return;
+        }
+    } else {
+        
+        refit_bvh(scn);
+    }
+    
+    stack_node[top] = 0;
+    stack_state[top++] = FRUSTUM_PARTIAL;
+    
+    while(top) {
+        
+        index = stack_node[--top];
+        state = stack_state[top];
+        node = &(scn->nodes[index]);
+        
+        if(state != FRUSTUM_INSIDE && (state = box_in_frustum(cam, &(node->bounds))) == FRUSTUM_OUTSIDE)
+            continue;
+            
+        if(box_occluded(cam, &(node->bounds)))
+            continue;
+            
+        if(node->count) {
+            
+            for(i = node->first; i < node->first + node->count; i++) {
+                
+                obj = scn->objects[scn->order[i]];
+                
+                if(state == FRUSTUM_INSIDE)
+                    submit_object(obj, cam);
+                else
+                    render_object(obj, cam);
+            }
+            
+            if(binned_count >= OCCLUSION_FLUSH)
+                render_bins();
+                
+            continue;
+        }
+        
+        if(box_distance2(cam, &(scn->nodes[node->left].bounds)) <= box_distance2(cam, &(scn->nodes[node->right].bounds))) {
+            
+            near_child = node->left;
+            far_child = node->right;
+        } else {
+            
+            near_child = node->right;
+            far_child = node->left;
+        }
+        
+        //The near child goes on last so it comes off first. With the tree
+        //split at the median it's never deep enough to run out of stack
+        stack_node[top] = far_child;
+        stack_state[top++] = state;
+        stack_node[top] = near_child;
+        stack_state[top++] = state;
+    }
+}
+
+//Distance along the ray to where it enters a box, or -1 if it misses or only
+//gets there past max_t. inv_dir is one over each component of the direction
+float ray_box(float *origin, float *inv_dir, box *b, float max_t) {
+    
+    int i;
+    float t0 = 0, t1 = max_t, near_t, far_t, t;
+    
+    for(i = 0; i < 3; i++) {
+        
+        near_t = (b->min[i] - origin[i]) * inv_dir[i];
+        far_t = (b->max[i] - origin[i]) * inv_dir[i];
+        
+        if(near_t > far_t) {
+            
+            t = near_t;
+            near_t = far_t;
+            far_t = t;
+        }
+        
+        t0 = near_t > t0 ? near_t : t0;
+        t1 = far_t < t1 ? far_t : t1;
+        
+        if(t0 > t1)
+            return -1;
+    }
+    
+    return t0;
+}
+
+//Distance along the ray to the nearest of an object's faces it hits, in
+//world space, or -1 if that's none of them closer than max_t
+float ray_object(object *obj, float *origin, float *dir, float max_t) {
+    
+    int i, j;
+    vertex v[3];
+    float e1[3], e2[3], pv[3], tv[3], qv[3], det, u, w, t, best = -1;
+    
+    for(i = 0; i < obj->face_count; i++) {
+        
+        for(j = 0; j < 3; j++)
+            transform_vertex(&(obj->model), &(obj->verts[obj->faces[i].v[j]]), &v[j]);
+            
+        //Moller-Trumbore
+        e1[0] = v[1].x - v[0].x; e1[1] = v[1].y - v[0].y; e1[2] = v[1].z - v[0].z;
+        e2[0] = v[2].x - v[0].x; e2[1] = v[2].y - v[0].y; e2[2] = v[2].z - v[0].z;
+        pv[0] = dir[1]*e2[2] - dir[2]*e2[1];
+        pv[1] = dir[2]*e2[0] - dir[0]*e2[2];
+        pv[2] = dir[0]*e2[1] - dir[1]*e2[0];
+        det = e1[0]*pv[0] + e1[1]*pv[1] + e1[2]*pv[2];
+        
+        if(fabs(det) < 1e-8)
+            continue;
+            
+        tv[0] = origin[0] - v[0].x; tv[1] = origin[1] - v[0].y; tv[2] = origin[2] - v[0].z;
+        u = (tv[0]*pv[0] + tv[1]*pv[1] + tv[2]*pv[2]) / det;
+        
+        if(u < 0 || u > 1)
+            continue;
+            
+        qv[0] = tv[1]*e1[2] - tv[2]*e1[1];
+        qv[1] = tv[2]*e1[0] - tv[0]*e1[2];
+        qv[2] = tv[0]*e1[1] - tv[1]*e1[0];
+        w = (dir[0]*qv[0] + dir[1]*qv[1] + dir[2]*qv[2]) / det;
+        
+        if(w < 0 || u + w > 1)
+            continue;
+            
+        t = (e2[0]*qv[0] + e2[1]*qv[1] + e2[2]*qv[2]) / det;
+        
+        if(t >= 0 && t <= max_t && (best < 0 || t < best))
+            best = t;
+    }
+    
+    return best;
+}
+
+//Find the nearest object the ray from origin along dir hits within max_t,
+//putting the distance to it in hit_t. Returns NULL if nothing is hit
+object *scene_raycast(scene *scn, float *origin, float *dir, float max_t, float *hit_t) {
+    
+    int stack[BVH_STACK], top = 0, i;
+    float inv_dir[3];
+    bvh_node *node;
+    object *hit = NULL;
+    float t;
+    
+    if(!scn->node_count && !build_bvh(scn))
+        return NULL;
+        
+    if(!scn->node_count)
+        return NULL;
+        
+    for(i = 0; i < 3; i++)
+        inv_dir[i] = dir[i] != 0 ? 1.0 / dir[i] : 1e30;
+        
+    stack[top++] = 0;
+    
+    while(top) {
+        
+        node = &(scn->nodes[stack[--top]]);
+        
+        //Anything entered past the nearest hit so far can't be nearer
+        if(ray_box(origin, inv_dir, &(node->bounds), max_t) < 0)
+            continue;
+            
+        if(node->count) {
+            
+            for(i = node->first; i < node->first + node->count; i++) {
+                
+                if(ray_box(origin, inv_dir, &(scn->objects[scn->order[i]]->world_bounds), max_t) < 0)
+                    continue;
+                    
+                if((t = ray_object(scn->objects[scn->order[i]], origin, dir, max_t)) >= 0) {
+                    
+                    max_t = t;
+                    hit = scn->objects[scn->order[i]];
+                }
+            }
+            
+            continue;
+        }
+        
+        stack[top++] = node->left;
+        stack[top++] = node->right;
+    }
+    
+    if(hit && hit_t)
+        *hit_t = max_t;
+        
+    return hit;
+}
+
+//Fill out with up to max_out of the objects whose bounds overlap the box, and
+//return how many overlap in all
+int scene_overlap(scene *scn, box *b, object **out, int max_out) {
+    
+    int stack[BVH_STACK], top = 0, i, found = 0;
+    bvh_node *node;
+    
+    if(!scn->node_count && !build_bvh(scn))
+        return 0;
+        
+    if(!scn->node_count)
+        return 0;
+        
+    stack[top++] = 0;
+    
+    while(top) {
+        
+        node = &(scn->nodes[stack[--top]]);
+        
+        if(!box_overlap(&(node->bounds), b))
+            continue;
+            
+        if(node->count) {
+            
+            for(i = node->first; i < node->first + node->count; i++) {
+                
+                if(!box_overlap(&(scn->objects[scn->order[i]]->world_bounds), b))
+                    continue;
+                    
+                if(found < max_out)
+                    out[found] = scn->objects[scn->order[i]];
+                    
+                found++;
+            }
+            
+            continue;
+        }
+        
+        stack[top++] = node->left;
+        stack[top++] = node->right;
+    }
+    
+    return found;
+}
+
+void init_bsp(bsp_tree *tree) {
+    
+    tree->nodes = NULL;
+    tree->node_count = tree->node_cap = 0;
+    tree->tris = NULL;
+    tree->tri_count = tree->tri_cap = 0;
+    tree->first_surface = tree->surface_count = 0;
+}
+
+void free_bsp(bsp_tree *tree) {
+    
+    free(tree->nodes);
+    free(tree->tris);
+    init_bsp(tree);
+}
+
+//Returns the index of the new node, or -1 if there wasn't room for it
+int new_bsp_node(bsp_tree *tree) {
+    
+    bsp_node *grown;
+    int new_cap;
+    
+    if(tree->node_count == tree->node_cap) {
+        
+        new_cap = tree->node_cap ? tree->node_cap * 2 : 64;
+        
+        if(!(grown = (bsp_node*)realloc(tree->nodes, new_cap * sizeof(bsp_node))))
+            return -1;
+            
+        tree->nodes = grown;
+        tree->node_cap = new_cap;
+    }
+    
+    return tree->node_count++;
+}
+
+int add_bsp_triangle(bsp_tree *tree, triangle *tri) {
+    
+    triangle *grown;
+    int new_cap;
+    
+    if(tree->tri_count == tree->tri_cap) {
+        
+        new_cap = tree->tri_cap ? tree->tri_cap * 2 : 256;
+        
+        if(!(grown = (triangle*)realloc(tree->tris, new_cap * sizeof(triangle))))
+            return 0;
+            
+        tree->tris = grown;
+        tree->tri_cap = new_cap;
+    }
+    
+    tree->tris[tree->tri_count++] = *tri;
+    
+    return 1;
+}
+
+//The plane a triangle lies in, with its normal along the triangle's front.
+//Returns zero for triangles with no area
+int triangle_plane(triangle *tri, float *plane) {
+    
+    float ax = tri->v[1].x - tri->v[0].x, ay = tri->v[1].y - tri->v[0].y, az = tri->v[1].z - tri->v[0].z;
+    float bx = tri->v[2].x - tri->v[0].x, by = tri->v[2].y - tri->v[0].y, bz = tri->v[2].z - tri->v[0].z;
+    float len;
+    
+    plane[0] = ay*bz - az*by;
+    plane[1] = az*bx - ax*bz;
+    plane[2] = ax*by - ay*bx;
+    len = sqrt(plane[0]*plane[0] + plane[1]*plane[1] + plane[2]*plane[2]);
+    
+    if(len == 0)
+        return 0;
+        
+    plane[0] /= len;
+    plane[1] /= len;
+    plane[2] /= len;
+    plane[3] = -(plane[0]*tri->v[0].x + plane[1]*tri->v[0].y + plane[2]*tri->v[0].z);
+    
+    return 1;
+}
+
+//Which side of a plane a triangle is on: 1 in front, -1 behind, 0 lying in
+//it and 2 across it. d gets each vertex's distance
+int classify_triangle(triangle *tri, float *plane, float *d) {
+    
+    int i, front = 0, back = 0;
+    
+    for(i = 0; i < 3; i++) {
+        
+        d[i] = plane[0]*tri->v[i].x + plane[1]*tri->v[i].y + plane[2]*tri->v[i].z + plane[3];
+        front += d[i] > BSP_EPSILON;
+        back += d[i] < -BSP_EPSILON;
+    }
+    
+    return front && back ? 2 : front ? 1 : back ? -1 : 0;
+}
+
+//Cut a triangle crossing a plane into the pieces on each side, as fans of
+//at most two triangles apiece. Vertices within the epsilon go on both sides
+void split_triangle(triangle *tri, float *d, triangle *front, int *front_count, triangle *back, int *back_count) {
+    
+    vertex fpoly[4], bpoly[4], cross;
+    int i, j, nf = 0, nb = 0;
+    float t;
+    
+    for(i = 0, j = 2; i < 3; j = i++) {
+        
+        //Where the edge from j to i passes through the plane, measured from
+        //the front end so both triangles sharing the edge agree on it
+        if((d[j] > BSP_EPSILON && d[i] < -BSP_EPSILON) || (d[j] < -BSP_EPSILON && d[i] > BSP_EPSILON)) {
+            
+            if(d[j] > 0) {
+                
+                t = d[j] / (d[j] - d[i]);
+                cross.x = tri->v[j].x + t * (tri->v[i].x - tri->v[j].x);
+                cross.y = tri->v[j].y + t * (tri->v[i].y - tri->v[j].y);
+                cross.z = tri->v[j].z + t * (tri->v[i].z - tri->v[j].z);
+                cross.u = tri->v[j].u + t * (tri->v[i].u - tri->v[j].u);
+                cross.v = tri->v[j].v + t * (tri->v[i].v - tri->v[j].v);
+                cross.nx = tri->v[j].nx + t * (tri->v[i].nx - tri->v[j].nx);
+                cross.ny = tri->v[j].ny + t * (tri->v[i].ny - tri->v[j].ny);
+                cross.nz = tri->v[j].nz + t * (tri->v[i].nz - tri->v[j].nz);
+            } else {
+                
+                t = d[i] / (d[i] - d[j]);
+                cross.x = tri->v[i].x + t * (tri->v[j].x - tri->v[i].x);
+                cross.y = tri->v[i].y + t * (tri->v[j].y - tri->v[i].y);
+                cross.z = tri->v[i].z + t * (tri->v[j].z - tri->v[i].z);
+                cross.u = tri->v[i].u + t * (tri->v[j].u - tri->v[i].u);
+                cross.v = tri->v[i].v + t * (tri->v[j].v - tri->v[i].v);
+                cross.nx = tri->v[i].nx + t * (tri->v[j].nx - tri->v[i].nx);
+                cross.ny = tri->v[i].ny + t * (tri->v[j].ny - tri->v[i].ny);
+                cross.nz = tri->v[i].nz + t * (tri->v[j].nz - tri->v[i].nz);
+            }
+            
+            cross.r = cross.g = cross.b = 0;
+            cross.c = tri->v[0].c;
+            fpoly[nf++] = cross;
+            bpoly[nb++] = cross;
+        }
+        
+        if(d[i] >= -BSP_EPSILON)
+            fpoly[nf++] = tri->v[i];
+            
+        if(d[i] <= BSP_EPSILON)
+            bpoly[nb++] = tri->v[i];
+    }
+    
+    *front_count = *back_count = 0;
+    
+    for(i = 1; i < nf - 1; i++, (*front_count)++) {
+        
+        front[*front_count].v[0] = fpoly[0];
+        front[*front_count].v[1] = fpoly[i];
+        front[*front_count].v[2] = fpoly[i + 1];
+        front[*front_count].tex = tri->tex;
+        front[*front_count].surface = tri->surface;
+    }
+    
+    for(i = 1; i < nb - 1; i++, (*back_count)++) {
+        
+        back[*back_count].v[0] = bpoly[0];
+        back[*back_count].v[1] = bpoly[i];
+        back[*back_count].v[2] = bpoly[i + 1];
+        back[*back_count].tex = tri->tex;
+        back[*back_count].surface = tri->surface;
+    }
+}
+
+//Pick the triangle whose plane splits the fewest others while leaving the two
+//sides most even, out of a spread of candidates
+int choose_splitter(triangle *list, int count) {
+    
+    int i, j, step, side, front, back, splits, score, best = 0, best_score = -1;
+    float plane[4], d[3];
+    
+    step = count > BSP_CANDIDATES ? count / BSP_CANDIDATES : 1;
+    
+    for(i = 0; i < count; i += step) {
+        
+        if(!triangle_plane(&list[i], plane))
+            continue;
+            
+        front = back = splits = 0;
+        
+        for(j = 0; j < count; j++) {
+            
+            side = classify_triangle(&list[j], plane, d);
+            front += side == 1;
+            back += side == -1;
+            splits += side == 2;
+        }
+        
+        score = BSP_SPLIT_COST * splits + (front > back ? front - back : back - front);
+        
+        if(best_score < 0 || score < best_score) {
+            
+            best = i;
+            best_score = score;
+        }
+    }
+    
+    return best;
+}
+
+void triangle_bounds(triangle *tri, box *b) {
+    
+    int i;
+    
+    for(i = 0; i < 3; i++) {
+        
+        b->min[0] = i == 0 || tri->v[i].x < b->min[0] ? tri->v[i].x : b->min[0];
+        b->min[1] = i == 0 || tri->v[i].y < b->min[1] ? tri->v[i].y : b->min[1];
+        b->min[2] = i == 0 || tri->v[i].z < b->min[2] ? tri->v[i].z : b->min[2];
+        b->max[0] = i == 0 || tri->v[i].x > b->max[0] ? tri->v[i].x : b->max[0];
+        b->max[1] = i == 0 || tri->v[i].y > b->max[1] ? tri->v[i].y : b->max[1];
+        b->max[2] = i == 0 || tri->v[i].z > b->max[2] ? tri->v[i].z : b->max[2];
+    }
+}
+
+//Build the subtree over a list of triangles and return the index of its root,
+//-1 for an empty list or -2 if the memory ran out
+int build_bsp_node(bsp_tree *tree, triangle *list, int count) {
+    
+    int index, i, j, side, nf, nb, front_count = 0, back_count = 0, facing = 0, child;
+    float plane[4], d[3], tri_plane[4];
+    triangle *front_list, *back_list, pieces_f[2], pieces_b[2];
+    box b;
+    
+    //Triangles without any area can't go anywhere useful, so drop them
+    while(count && !triangle_plane(&list[count - 1], plane))
+        count--;
+        
+    if(!count)
+        return -1;
+        
+    i = choose_splitter(list, count);
+    
+    if(!triangle_plane(&list[i], plane)) {
+        
+        list[i] = list[--count];
+        return build_bsp_node(tree, list, count);
+    }
+        
+    //Each split leaves at most two triangles on a side
+    front_list = (triangle*)malloc(2 * count * sizeof(triangle));
+    back_list = (triangle*)malloc(2 * count * sizeof(triangle));
+    
+    if(!front_list || !back_list || (index = new_bsp_node(tree)) < 0) {
+        
+        free(front_list);
+        free(back_list);
+        return -2;
+    }
+    
+    tree->nodes[index].plane[0] = plane[0];
+    tree->nodes[index].plane[1] = plane[1];
+    tree->nodes[index].plane[2] = plane[2];
+    tree->nodes[index].plane[3] = plane[3];
+    tree->nodes[index].first = tree->tri_count;
+    tree->nodes[index].front_count = tree->nodes[index].back_count = 0;
+    tree->nodes[index].front = tree->nodes[index].back = -1;
+    
+    //The triangles lying in the plane stay with this node, the ones facing
+    //along it ahead of the rest. Anything else goes down one side or the
+    //other, or is cut in two
+    for(facing = 1; facing >= 0; facing--) {
+        
+        for(j = 0; j < count; j++) {
+            
+            if(classify_triangle(&list[j], plane, d) != 0 || !triangle_plane(&list[j], tri_plane))
+                continue;
+                
+            if((tri_plane[0]*plane[0] + tri_plane[1]*plane[1] + tri_plane[2]*plane[2] > 0) != facing)
+                continue;
+                
+            if(!add_bsp_triangle(tree, &list[j])) {
+                
+                free(front_list);
+                free(back_list);
+                return -2;
+            }
+            
+            if(facing)
+                tree->nodes[index].front_count++;
+            else
+                tree->nodes[index].back_count++;
+        }
+    }
+    
+    for(j = 0; j < count; j++) {
+        
+        side = classify_triangle(&list[j], plane, d);
+        
+        if(side == 1) {
+            
+            front_list[front_count++] = list[j];
+        } else if(side == -1) {
+            
+            back_list[back_count++] = list[j];
+        } else if(side == 2) {
+            
+            split_triangle(&list[j], d, pieces_f, &nf, pieces_b, &nb);
+            
+            for(i = 0; i < nf; i++)
+                front_list[front_count++] = pieces_f[i];
+                
+            for(i = 0; i < nb; i++)
+                back_list[back_count++] = pieces_b[i];
+        }
+    }
+    
+    child = build_bsp_node(tree, front_list, front_count);
+    tree->nodes[index].front = child;
+    free(front_list);
+    
+    if(child == -2) {
+        
+        free(back_list);
+        return -2;
+    }
+    
+    child = build_bsp_node(tree, back_list, back_count);
+    tree->nodes[index].back = child;
+    free(back_list);
+    
+    if(child == -2)
+        return -2;
+        
+    //The subtree's bounds take in this node's own triangles and both sides
+    triangle_bounds(&(tree->tris[tree->nodes[index].first]), &(tree->nodes[index].bounds));
+    
+    for(i = 1; i < tree->nodes[index].front_count + tree->nodes[index].back_count; i++) {
+        
+        triangle_bounds(&(tree->tris[tree->nodes[index].first + i]), &b);
+        box_union(&(tree->nodes[index].bounds), &b, &(tree->nodes[index].bounds));
+    }
+    
+    if(tree->nodes[index].front >= 0)
+        box_union(&(tree->nodes[index].bounds), &(tree->nodes[tree->nodes[index].front].bounds), &(tree->nodes[index].bounds));
+        
+    if(tree->nodes[index].back >= 0)
+        box_union(&(tree->nodes[index].bounds), &(tree->nodes[tree->nodes[index].back].bounds), &(tree->nodes[index].bounds));
+        
+    return index;
+}
+
+//Compile an object's mesh, placed in the world by its model matrix as it
+//stands, into a BSP. Returns zero if the memory ran out
+int compile_bsp(bsp_tree *tree, object *obj) {
+    
+    int i, j, ret;
+    triangle *list;
+    float (*planes)[4];
+    
+    init_bsp(tree);
+    
+    if(!obj->face_count)
+        return 1;
+        
+    list = (triangle*)malloc(obj->face_count * sizeof(triangle));
+    planes = (float(*)[4])malloc(obj->face_count * sizeof(float[4]));
+    
+    if(!list || !planes) {
+        
+        free(list);
+        free(planes);
+        return 0;
+    }
+    
+    tree->first_surface = surface_count;
+        
+    for(i = 0; i < obj->face_count; i++) {
+        
+        for(j = 0; j < 3; j++) {
+            
+            transform_vertex(&(obj->model), &(obj->verts[obj->faces[i].v[j]]), &(list[i].v[j]));
+            list[i].v[j].u = obj->faces[i].uv[j][0];
+            list[i].v[j].v = obj->faces[i].uv[j][1];
+        }
+        
+        list[i].tex = obj->tex;
+        
+        //Faces lying in the same plane are lit the same, so they share a
+        //surface and with it their lit texture in the surface cache
+        list[i].surface = -1;
+        
+        if(triangle_plane(&list[i], planes[i])) {
+            
+            for(j = 0; j < i && list[i].surface < 0; j++)
+                if(list[j].tex == list[i].tex &&
+                   planes[i][0]*planes[j][0] + planes[i][1]*planes[j][1] + planes[i][2]*planes[j][2] > 1 - BSP_EPSILON &&
+                   fabs(planes[i][3] - planes[j][3]) < BSP_EPSILON)
+                    list[i].surface = list[j].surface;
+        } else {
+            
+            planes[i][0] = planes[i][1] = planes[i][2] = planes[i][3] = 0;
+        }
+        
+        if(list[i].surface < 0)
+            list[i].surface = tree->first_surface + tree->surface_count++;
+    }
+    
+    surface_count += tree->surface_count;
+    ret = build_bsp_node(tree, list, obj->face_count) != -2;
+    free(list);
+    free(planes);
+    
+    if(!ret)
+        free_bsp(tree);
+        
+    return ret;
+}
+
+//Write a box out to an open file as its two corners. Returns zero on failure
+int write_box(box *b, FILE *f) {
+    
+    return fwrite(b->min, sizeof(float), 3, f) == 3 && fwrite(b->max, sizeof(float), 3, f) == 3;
+}
+
+int read_box(box *b, FILE *f) {
+    
+    return fread(b->min, sizeof(float), 3, f) == 3 && fread(b->max, sizeof(float), 3, f) == 3;
+}
+
+//Write a BSP node out a field at a time, so that the file doesn't depend on
+//how the compiler lays the struct out. Returns zero on failure
+int write_bsp_node(bsp_node *node, FILE *f) {
+    
+    return fwrite(node->plane, sizeof(float), 4, f) == 4 &&
+           write_box(&(node->bounds), f) &&
+           fwrite(&(node->first), sizeof(int), 1, f) == 1 &&
+           fwrite(&(node->front_count), sizeof(int), 1, f) == 1 &&
+           fwrite(&(node->back_count), sizeof(int), 1, f) == 1 &&
+           fwrite(&(node->front), sizeof(int), 1, f) == 1 &&
+           fwrite(&(node->back), sizeof(int), 1, f) == 1;
+}
+
+int read_bsp_node(bsp_node *node, FILE *f) {
+    
+    return fread(node->plane, sizeof(float), 4, f) == 4 &&
+           read_box(&(node->bounds), f) &&
+           fread(&(node->first), sizeof(int), 1, f) == 1 &&
+           fread(&(node->front_count), sizeof(int), 1, f) == 1 &&
+           fread(&(node->back_count), sizeof(int), 1, f) == 1 &&
+           fread(&(node->front), sizeof(int), 1, f) == 1 &&
+           fread(&(node->back), sizeof(int), 1, f) == 1;
+}
+
+//Write a compiled BSP out to an open file so that it can be loaded later
+//without compiling it again. Colors are stored by value and textures by their
+//registry id, so the same textures have to be made again before loading.
+//Surfaces are stored counting from the tree's first. Returns zero on failure
+int write_bsp(bsp_tree *tree, FILE *f) {
+    
+    int i, j, version = BSP_VERSION, ok, id, surface;
+    unsigned char rgba[4];
+    
+    ok = fwrite(BSP_MAGIC, 4, 1, f) == 1 &&
+         fwrite(&version, sizeof(int), 1, f) == 1 &&
+         fwrite(&(tree->node_count), sizeof(int), 1, f) == 1 &&
+         fwrite(&(tree->tri_count), sizeof(int), 1, f) == 1 &&
+         fwrite(&(tree->surface_count), sizeof(int), 1, f) == 1;
+         
+    for(i = 0; ok && i < tree->node_count; i++)
+        ok = write_bsp_node(&(tree->nodes[i]), f);
+         
+    for(i = 0; ok && i < tree->tri_count; i++) {
+        
+        for(j = 0; ok && j < 3; j++)
+            ok = fwrite(&(tree->tris[i].v[j].x), sizeof(float), 1, f) == 1 &&
+                 fwrite(&(tree->tris[i].v[j].y), sizeof(float), 1, f) == 1 &&
+                 fwrite(&(tree->tris[i].v[j].z), sizeof(float), 1, f) == 1 &&
+                 fwrite(&(tree->tris[i].v[j].u), sizeof(float), 1, f) == 1 &&
+                 fwrite(&(tree->tris[i].v[j].v), sizeof(float), 1, f) == 1 &&
+                 fwrite(&(tree->tris[i].v[j].nx), sizeof(float), 1, f) == 1 &&
+                 fwrite(&(tree->tris[i].v[j].ny), sizeof(float), 1, f) == 1 &&
+                 fwrite(&(tree->tris[i].v[j].nz), sizeof(float), 1, f) == 1;
+                 
+        rgba[0] = tree->tris[i].v[0].c->r;
+        rgba[1] = tree->tris[i].v[0].c->g;
+        rgba[2] = tree->tris[i].v[0].c->b;
+        rgba[3] = tree->tris[i].v[0].c->a;
+        id = tree->tris[i].tex ? tree->tris[i].tex->id : -1;
+        surface = tree->tris[i].surface - tree->first_surface;
+        ok = ok && fwrite(rgba, 4, 1, f) == 1 && fwrite(&id, sizeof(int), 1, f) == 1 &&
+             fwrite(&surface, sizeof(int), 1, f) == 1;
+    }
+    
+    return ok;
+}
+
+int save_bsp(bsp_tree *tree, char *path) {
+    
+    FILE *f;
+    int ok;
+    
+    if(!(f = fopen(path, "wb")))
+        return 0;
+        
+    ok = write_bsp(tree, f);
+    
+    return fclose(f) == 0 && ok;
+}
+
+//Read back a BSP written by write_bsp. Its colors go in the scene arena, and
+//its surfaces are numbered after those of everything compiled or loaded so
+//far. Returns zero on failure, including for a texture id that isn't
+//registered
+int read_bsp(bsp_tree *tree, FILE *f) {
+    
+    int i, j, version, ok, id, surface;
+    char magic[4];
+    unsigned char rgba[4];
+    color *c;
+    
+    init_bsp(tree);
+    
+    ok = fread(magic, 4, 1, f) == 1 && !memcmp(magic, BSP_MAGIC, 4) &&
+         fread(&version, sizeof(int), 1, f) == 1 && version == BSP_VERSION &&
+         fread(&(tree->node_count), sizeof(int), 1, f) == 1 &&
+         fread(&(tree->tri_count), sizeof(int), 1, f) == 1 &&
+         fread(&(tree->surface_count), sizeof(int), 1, f) == 1 &&
+         tree->node_count >= 0 && tree->tri_count >= 0 && tree->surface_count >= 0;
+         
+    if(ok) {
+        
+        tree->node_cap = tree->node_count;
+        tree->tri_cap = tree->tri_count;
+        tree->nodes = (bsp_node*)malloc((tree->node_count ? tree->node_count : 1) * sizeof(bsp_node));
+        tree->tris = (triangle*)malloc((tree->tri_count ? tree->tri_count : 1) * sizeof(triangle));
+        ok = tree->nodes && tree->tris;
+    }
+    
+    for(i = 0; ok && i < tree->node_count; i++)
+        ok = read_bsp_node(&(tree->nodes[i]), f);
+    
+    for(i = 0; ok && i < tree->tri_count; i++) {
+        
+        for(j = 0; ok && j < 3; j++)
+            ok = fread(&(tree->tris[i].v[j].x), sizeof(float), 1, f) == 1 &&
+                 fread(&(tree->tris[i].v[j].y), sizeof(float), 1, f) == 1 &&
+                 fread(&(tree->tris[i].v[j].z), sizeof(float), 1, f) == 1 &&
+                 fread(&(tree->tris[i].v[j].u), sizeof(float), 1, f) == 1 &&
+                 fread(&(tree->tris[i].v[j].v), sizeof(float), 1, f) == 1 &&
+                 fread(&(tree->tris[i].v[j].nx), sizeof(float), 1, f) == 1 &&
+                 fread(&(tree->tris[i].v[j].ny), sizeof(float), 1, f) == 1 &&
+                 fread(&(tree->tris[i].v[j].nz), sizeof(float), 1, f) == 1;
+                 
+        ok = ok && fread(rgba, 4, 1, f) == 1 && (c = new_color(rgba[0], rgba[1], rgba[2], rgba[3])) &&
+             fread(&id, sizeof(int), 1, f) == 1 && id >= -1 && id < texture_count &&
+             fread(&surface, sizeof(int), 1, f) == 1 && surface >= 0 && surface < tree->surface_count;
+        
+        if(ok) {
+            
+            tree->tris[i].tex = id < 0 ? NULL : textures[id];
+            tree->tris[i].surface = surface_count + surface;
+        }
+        
+        for(j = 0; ok && j < 3; j++)
+            tree->tris[i].v[j].c = c;
+    }
+    
+    if(!ok) {
+        
+        free_bsp(tree);
+        return 0;
+    }
+    
+    tree->first_surface = surface_count;
+    surface_count += tree->surface_count;
+    
+    return 1;
+}
+
+int load_bsp(bsp_tree *tree, char *path) {
+    
+    FILE *f;
+    int ok;
+    
+    init_bsp(tree);
+    
+    if(!(f = fopen(path, "rb")))
+        return 0;
+        
+    ok = read_bsp(tree, f);
+    fclose(f);
+    
+    return ok;
+}
+
+//Draw the environment front to back from the camera, so that the bins get
+//their triangles in the order that lets the depth tests reject the most, and
+//that the span buffer relies on.
+//Subtrees outside the frustum are skipped, and only the triangles in each
+//node facing the camera are drawn
+void render_bsp(bsp_tree *tree, camera *cam) {
+    
+    int *stack, top = 0, entry, index, kind, state, near_side, far_side, i, first, count;
+    float side, sign;
+    bsp_node *node;
+    triangle tri;
+    
+    if(!tree->node_count)
+        return;
+        
+    //Each node visited swaps itself for at most three entries, so the stack
+    //never needs to be deeper than this
+    if(!(stack = (int*)arena_alloc(&frame_arena, (2 * tree->node_count + 1) * sizeof(int)))) {
+        
+        printf("[render_bsp] failed to allocate traversal stack\n");
+        return;
+    }
+    
+    //Entries are a node index times four plus what to do with it: visit it
+    //testing against the frustum, visit it knowing it's all inside, or draw
+    //its own triangles
+    stack[top++] = 0 * 4 + FRUSTUM_PARTIAL;
+    set_static_geometry(1);
+    
+    while(top) {
+        
+        entry = stack[--top];
+        index = entry / 4;
+        kind = entry % 4;
+        node = &(tree->nodes[index]);
+        side = node->plane[0]*cam->x + node->plane[1]*cam->y + node->plane[2]*cam->z + node->plane[3];
+        
+        if(kind == 3) {
+            
+            first = side >= 0 ? node->first : node->first + node->front_count;
+            count = side >= 0 ? node->front_count : node->back_count;
+            
+            //Only the triangles facing the camera get drawn, so they all
+            //share the normal of the side of the plane it's on
+            sign = side >= 0 ? 1.0 : -1.0;
+            transform_normal(&(cam->view_proj), sign*node->plane[0], sign*node->plane[1], sign*node->plane[2], &(tri.nx), &(tri.ny), &(tri.nz));
+            
+            for(i = first; i < first + count; i++) {
+                
+                transform_vertex(&(cam->view_proj), &(tree->tris[i].v[0]), &(tri.v[0]));
+                transform_vertex(&(cam->view_proj), &(tree->tris[i].v[1]), &(tri.v[1]));
+                transform_vertex(&(cam->view_proj), &(tree->tris[i].v[2]), &(tri.v[2]));
+                light_vertex(&(tri.v[0]));
+                light_vertex(&(tri.v[1]));
+                light_vertex(&(tri.v[2]));
+                tri.tex = tree->tris[i].tex;
+                tri.surface = tree->tris[i].surface;
+                render_triangle(&tri);
+            }
+            
+            continue;
+        }
+        
+        state = kind;
+        
+        if(state != FRUSTUM_INSIDE && (state = box_in_frustum(cam, &(node->bounds))) == FRUSTUM_OUTSIDE)
+            continue;
+            
+        near_side = side >= 0 ? node->front : node->back;
+        far_side = side >= 0 ? node->back : node->front;
+        
+        if(far_side >= 0)
+            stack[top++] = far_side * 4 + state;
+            
+        stack[top++] = index * 4 + 3;
+        
+        if(near_side >= 0)
+            stack[top++] = near_side * 4 + state;
+    }
+    
+    set_static_geometry(0);
+}
+
+void init_sector_map(sector_map *map) {
+    
+    map->sectors = NULL;
+    map->sector_count = map->sector_cap = 0;
+    map->portals = NULL;
+    map->portal_count = map->portal_cap = 0;
+    map->pvs = NULL;
+    map->pvs_stride = 0;
+}
+
+void free_sector_map(sector_map *map) {
+    
+    int i;
+    
+    for(i = 0; i < map->sector_count; i++)
+        free_bsp(&(map->sectors[i].geometry));
+        
+    free(map->sectors);
+    free(map->portals);
+    free(map->pvs);
+    init_sector_map(map);
+}
+
+//Make a new sector out of an object's mesh, compiling it into the sector's
+//own BSP where the object stands. Returns its index, or -1 on failure
+int add_sector(sector_map *map, object *obj) {
+    
+    sector *grown;
+    int new_cap;
+    
+    if(map->sector_count == map->sector_cap) {
+        
+        new_cap = map->sector_cap ? map->sector_cap * 2 : 16;
+        
+        if(!(grown = (sector*)realloc(map->sectors, new_cap * sizeof(sector))))
+            return -1;
+            
+        map->sectors = grown;
+        map->sector_cap = new_cap;
+    }
+    
+    if(!compile_bsp(&(map->sectors[map->sector_count].geometry), obj))
+        return -1;
+        
+    map->sectors[map->sector_count].bounds = obj->world_bounds;
+    map->sectors[map->sector_count].first_portal = 0;
+    map->sectors[map->sector_count].portal_count = 0;
+    
+    //The visibility it was compiled with no longer covers everything
+    free(map->pvs);
+    map->pvs = NULL;
+    
+    return map->sector_count++;
+}
+
+int add_portal_side(sector_map *map, int from, int to, float (*v)[3], int count) {
+    
+    portal *grown, *p;
+    int new_cap, i, j;
+    float c[3], len;
+    
+    if(map->portal_count == map->portal_cap) {
+        
+        new_cap = map->portal_cap ? map->portal_cap * 2 : 32;
+        
+        if(!(grown = (portal*)realloc(map->portals, new_cap * sizeof(portal))))
+            return 0;
+            
+        map->portals = grown;
+        map->portal_cap = new_cap;
+    }
+    
+    p = &(map->portals[map->portal_count]);
+    p->from = from;
+    p->to = to;
+    p->count = count;
+    p->plane[0] = p->plane[1] = p->plane[2] = 0;
+    memset(p->v, 0, sizeof(p->v));
+    
+    //Newell's method, which doesn't care how flat the polygon really is
+    for(i = 0, j = count - 1; i < count; j = i++) {
+        
+        p->v[i][0] = v[i][0];
+        p->v[i][1] = v[i][1];
+        p->v[i][2] = v[i][2];
+        p->plane[0] += (v[j][1] - v[i][1]) * (v[j][2] + v[i][2]);
+        p->plane[1] += (v[j][2] - v[i][2]) * (v[j][0] + v[i][0]);
+        p->plane[2] += (v[j][0] - v[i][0]) * (v[j][1] + v[i][1]);
+    }
+    
+    len = sqrt(p->plane[0]*p->plane[0] + p->plane[1]*p->plane[1] + p->plane[2]*p->plane[2]);
+    
+    if(len == 0)
+        return 0;
+        
+    p->plane[3] = 0;
+    
+    for(i = 0; i < 3; i++) {
+        
+        p->plane[i] /= len;
+        p->plane[3] -= p->plane[i] * v[0][i];
+        c[i] = (map->sectors[to].bounds.min[i] + map->sectors[to].bounds.max[i]) / 2.0;
+    }
+    
+    //Face the plane into the sector the portal leads to, whichever way the
+    //polygon was wound
+    if(p->plane[0]*c[0] + p->plane[1]*c[1] + p->plane[2]*c[2] + p->plane[3] < 0)
+        for(i = 0; i < 4; i++)
+            p->plane[i] = -p->plane[i];
+            
+    map->portal_count++;
+    
+    return 1;
+}
+
+//Join two sectors through a convex polygon of world space points, which can
+//then be looked through either way. Returns zero on failure
+int add_portal(sector_map *map, int a, int b, float (*v)[3], int count) {
+    
+    if(count < 3 || count > PORTAL_MAX_VERTS || a == b)
+        return 0;
+        
+    if(!add_portal_side(map, a, b, v, count))
+        return 0;
+        
+    if(!add_portal_side(map, b, a, v, count)) {
+        
+        map->portal_count--;
+        return 0;
+    }
+    
+    free(map->pvs);
+    map->pvs = NULL;
+    
+    return 1;
+}
+
+int portal_compare(const void *a, const void *b) {
+    
+    return ((const portal*)a)->from - ((const portal*)b)->from;
+}
+
+//Whether a line of sight could pass through portal a and then on through b.
+//That needs some of b past a, and some of a behind b
+int portal_ahead(portal *a, portal *b) {
+    
+    int i, ahead = 0, behind = 0;
+    
+    for(i = 0; i < b->count && !ahead; i++)
+        ahead = a->plane[0]*b->v[i][0] + a->plane[1]*b->v[i][1] + a->plane[2]*b->v[i][2] + a->plane[3] > BSP_EPSILON;
+        
+    for(i = 0; i < a->count && !behind; i++)
+        behind = b->plane[0]*a->v[i][0] + b->plane[1]*a->v[i][1] + b->plane[2]*a->v[i][2] + b->plane[3] < -BSP_EPSILON;
+        
+    return ahead && behind;
+}
+
+//Mark every sector reachable onward from the chain of depth portals in path,
+//keeping only portals that could be seen through along with all of the
+//chain. This overestimates what's visible but never misses anything
+void flood_pvs(sector_map *map, unsigned char *row, int *path, int depth, unsigned char *on_path) {
+    
+    int i, k;
+    sector *cur = &(map->sectors[map->portals[path[depth - 1]].to]);
+    portal *next;
+    
+    for(i = cur->first_portal; i < cur->first_portal + cur->portal_count; i++) {
+        
+        next = &(map->portals[i]);
+        
+        if(on_path[next->to])
+            continue;
+            
+        for(k = 0; k < depth; k++)
+            if(!portal_ahead(&(map->portals[path[k]]), next))
+                break;
+                
+        if(k < depth)
+            continue;
+            
+        row[next->to / 8] |= 1 << (next->to % 8);
+        
+        if(depth == SECTOR_MAX_DEPTH)
+            continue;
+            
+        on_path[next->to] = 1;
+        path[depth] = i;
+        flood_pvs(map, row, path, depth + 1, on_path);
+        on_path[next->to] = 0;
+    }
+}
+
+//Work out the potentially visible set of every sector. This is the slow part
+//of compiling a level and is meant to be done offline, with the result saved
+//along with it. Returns zero if the memory ran out
+int build_pvs(sector_map *map) {
+    
+    int i, s, path[SECTOR_MAX_DEPTH];
+    unsigned char *row, *on_path;
+    sector *sec;
+    
+    //Group the portals by the sector they lead out of
+    if(map->portal_count)
+        qsort(map->portals, map->portal_count, sizeof(portal), portal_compare);
+    
+    for(s = 0; s < map->sector_count; s++)
+        map->sectors[s].portal_count = 0;
+        
+    for(i = map->portal_count - 1; i >= 0; i--) {
+        
+        map->sectors[map->portals[i].from].first_portal = i;
+        map->sectors[map->portals[i].from].portal_count++;
+    }
+    
+    free(map->pvs);
+    map->pvs_stride = (map->sector_count + 7) / 8;
+    map->pvs = (unsigned char*)calloc(map->sector_count * map->pvs_stride + 1, 1);
+    on_path = (unsigned char*)calloc(map->sector_count + 1, 1);
+    
+    if(!map->pvs || !on_path) {
+        
+        free(map->pvs);
+        free(on_path);
+        map->pvs = NULL;
+        return 0;
+    }
     
-    float rad_angle = DEG_TO_RAD(angle);
-    triangle *temp_tri;
-    node     *item;
-    int      i, j;
-    float temp_x, temp_y;
+    for(s = 0; s < map->sector_count; s++) {
         
-    list_for_each(&(obj->tri_list), item, i) {
+        sec = &(map->sectors[s]);
+        row = &(map->pvs[s * map->pvs_stride]);
+        row[s / 8] |= 1 << (s % 8);
+        on_path[s] = 1;
         
-        temp_tri = (triangle*)(item->payload);
-        
-        for(j = 0; j < 3; j++) {
+        //Neighbours are always visible, and whatever lies beyond them has to
+        //be seen through the portal to them
+        for(i = sec->first_portal; i < sec->first_portal + sec->portal_count; i++) {
             
-            temp_x = temp_tri->v[j].x;
-            temp_y = temp_tri->v[j].y;
-            
-            temp_tri->v[j].x = (temp_x * cos(rad_angle)) - (temp_y * sin(rad_angle));
-            temp_tri->v[j].y = (temp_x * sin(rad_angle)) + (temp_y * cos(rad_angle));
+            row[map->portals[i].to / 8] |= 1 << (map->portals[i].to % 8);
+            on_path[map->portals[i].to] = 1;
+            path[0] = i;
+            flood_pvs(map, row, path, 1, on_path);
+            on_path[map->portals[i].to] = 0;
         }
+        
+        on_path[s] = 0;
     }
-}
-
-void rotate_object_x_local(object* obj, float angle) {
     
-    float oldx, oldy, oldz;
+    free(on_path);
     
-    oldx = obj->x;
-    oldy = obj->y;
-    oldz = obj->z;
+    return 1;
+}
+
+//Write a portal out a field at a time, the same way as write_bsp_node. All
+//of its vertex slots go out, used or not. Returns zero on failure
+int write_portal(portal *p, FILE *f) {
     
-    translate_object(obj, -oldx, -oldy, -oldz);
-    rotate_object_x_global(obj, angle);
-    translate_object(obj, oldx, oldy, oldz);
+    return fwrite(p->v, sizeof(float), PORTAL_MAX_VERTS * 3, f) == PORTAL_MAX_VERTS * 3 &&
+           fwrite(&(p->count), sizeof(int), 1, f) == 1 &&
+           fwrite(p->plane, sizeof(float), 4, f) == 4 &&
+           fwrite(&(p->from), sizeof(int), 1, f) == 1 &&
+           fwrite(&(p->to), sizeof(int), 1, f) == 1;
 }
 
-void rotate_object_y_local(object* obj, float angle) {
+//Read a portal back, checking that it joins two of the map's sector_count
+//sectors. Returns zero on failure
+int read_portal(portal *p, int sector_count, FILE *f) {
     
-    float oldx, oldy, oldz;
+    return fread(p->v, sizeof(float), PORTAL_MAX_VERTS * 3, f) == PORTAL_MAX_VERTS * 3 &&
+           fread(&(p->count), sizeof(int), 1, f) == 1 && p->count >= 3 && p->count <= PORTAL_MAX_VERTS &&
+           fread(p->plane, sizeof(float), 4, f) == 4 &&
+           fread(&(p->from), sizeof(int), 1, f) == 1 && p->from >= 0 && p->from < sector_count &&
+           fread(&(p->to), sizeof(int), 1, f) == 1 && p->to >= 0 && p->to < sector_count;
+}
+
+//Write a compiled sector map out, visibility and all. Returns zero on failure
+int save_sectors(sector_map *map, char *path) {
     
-    oldx = obj->x;
-    oldy = obj->y;
-    oldz = obj->z;
+    FILE *f;
+    int i, version = SECTOR_VERSION, ok;
     
-    translate_object(obj, -oldx, -oldy, -oldz);
-    rotate_object_y_global(obj, angle);
-    translate_object(obj, oldx, oldy, oldz);
+    if(!map->pvs || !(f = fopen(path, "wb")))
+        return 0;
+        
+    ok = fwrite(SECTOR_MAGIC, 4, 1, f) == 1 &&
+         fwrite(&version, sizeof(int), 1, f) == 1 &&
+         fwrite(&(map->sector_count), sizeof(int), 1, f) == 1 &&
+         fwrite(&(map->portal_count), sizeof(int), 1, f) == 1;
+         
+    for(i = 0; ok && i < map->portal_count; i++)
+        ok = write_portal(&(map->portals[i]), f);
+        
+    ok = ok && (map->sector_count == 0 || fwrite(map->pvs, map->pvs_stride, map->sector_count, f) == (size_t)map->sector_count);
+         
+    for(i = 0; ok && i < map->sector_count; i++)
+        ok = write_box(&(map->sectors[i].bounds), f) &&
+             fwrite(&(map->sectors[i].first_portal), sizeof(int), 1, f) == 1 &&
+             fwrite(&(map->sectors[i].portal_count), sizeof(int), 1, f) == 1 &&
+             write_bsp(&(map->sectors[i].geometry), f);
+             
+    return fclose(f) == 0 && ok;
 }
 
-void rotate_object_z_local(object* obj, float angle) {
+//Read back a sector map written by save_sectors. Returns zero on failure
+int load_sectors(sector_map *map, char *path) {
     
-    float oldx, oldy, oldz;
+    FILE *f;
+    int i, version, count, ok;
+    char magic[4];
     
-    oldx = obj->x;
-    oldy = obj->y;
-    oldz = obj->z;
+    init_sector_map(map);
     
-    translate_object(obj, -oldx, -oldy, -oldz);
-    rotate_object_z_global(obj, angle);
-    translate_object(obj, oldx, oldy, oldz);
-}
-
-void project(vertex* v, screen_point* p) {
-
-    float delta = (v->z == 0.0) ? 1.0 : (focal_length/v->z);
-
-    p->x = TO_SCREEN_X(v->x * delta);
-    p->y = TO_SCREEN_Y(v->y * delta);
-    p->z = TO_SCREEN_Z(v->z);
-}
-
-//Draw an rgb-colored line along the scanline from x=x1 to x=x2, interpolating
-//z-values and only drawing the pixel if the interpolated z-value is less than
-//the value already written to the z-buffer
-void draw_scanline(SDL_Renderer *r, float scanline, float x0, float z0, float x1, float z1) {
-
-    unsigned short newz;
-    int z_addr;	
-	float dz, dx, m, newz_f, t; 
-                 
-    //don't draw off the screen
-    if(scanline >= SCREEN_HEIGHT || scanline < 0)
-    	return;  
-      
-    if(x0 > x1) {
-     
-        t = x0;
-        x0 = x1;
-        x1 = t;
-        t = z0;
-        z0 = z1;
-        z1 = t;
-    } 
-    	    
-	dz = z1 - z0;
-    dx = x1 - x0;
-    m = dx ? dz/dx : 0;
-    z_addr = scanline * SCREEN_WIDTH + x0;
-       
-    for(; x0 <= x1; x0 += 1, z_addr++) {
-
-        if(x0 < SCREEN_WIDTH && x0 >= 0) {
-
-            newz_f = m*(x0 - x1) + z1;
-            newz = (unsigned short)(newz_f >= 65535 ? 65535 : newz_f < 0 ? 0 : newz_f);
-            
-            //Check the z buffer and draw the point	
-            if(newz < zbuf[z_addr]) {
-                
-                    //Uncomment the below to view the depth buffer
-                    //SDL_SetRenderDrawColor(r, newz >> 8, newz >> 8, newz >> 8, 0xFF);
-                    SDL_RenderDrawPoint(r, (int)x0, (int)scanline);
-                    zbuf[z_addr] = newz;
-            }
-        }
-    }
-}
-
-//Draw an rgb-colored line along the scanline from x=x1 to x=x2, interpolating
-//z-values and only drawing the pixel if the interpolated z-value is less than
-//the value already written to the z-buffer
-void draw_scanline_old(SDL_Renderer *r, int scanline, int x0, int z0, int x1, int z1) {
-
-    int dx, sx, dz, sz, err, te, z_addr;	
-	   
-    //don't draw off the screen
-    if(scanline >= SCREEN_HEIGHT || scanline < 0)
-    	return;
-	    
-    dx = abs(x1 - x0);
-    sx = x0 < x1 ? 1 : -1;
-    dz = abs(z1 - z0);
-    sz = z0 < z1 ? 1 : -1;
-    err = (dx > dz ? dx : dz) / 2;
-	z_addr = scanline * SCREEN_WIDTH + x0;
-       
-    while(1) {
+    if(!(f = fopen(path, "rb")))
+        return 0;
         
+    ok = fread(magic, 4, 1, f) == 1 && !memcmp(magic, SECTOR_MAGIC, 4) &&
+         fread(&version, sizeof(int), 1, f) == 1 && version == SECTOR_VERSION &&
+         fread(&count, sizeof(int), 1, f) == 1 &&
+         fread(&(map->portal_count), sizeof(int), 1, f) == 1 &&
+         count >= 0 && map->portal_count >= 0;
+         
+    if(ok) {
         
-	if(x0 < SCREEN_WIDTH && x0 >= 0) {
+        map->portal_cap = map->portal_count;
+        map->sector_cap = count;
+        map->pvs_stride = (count + 7) / 8;
+        map->portals = (portal*)malloc((map->portal_count ? map->portal_count : 1) * sizeof(portal));
+        map->sectors = (sector*)malloc((count ? count : 1) * sizeof(sector));
+        map->pvs = (unsigned char*)malloc(count * map->pvs_stride + 1);
+        ok = map->portals && map->sectors && map->pvs;
+    }
+    
+    for(i = 0; ok && i < map->portal_count; i++)
+        ok = read_portal(&(map->portals[i]), count, f);
         
-	    //Check the z buffer and draw the point	
-	    if(z0 < zbuf[z_addr]) {
-            
-                //Uncomment the below to view the depth buffer
-                SDL_SetRenderDrawColor(r, z0, z0, z0, 0xFF);
-                SDL_RenderDrawPoint(r, x0, scanline);
-                zbuf[z_addr] = (unsigned short)z0;
-           }
-	}
+    ok = ok && (count == 0 || fread(map->pvs, map->pvs_stride, count, f) == (size_t)count);
+    
+    //Sectors only count once their geometry is in, so that a failure part
+    //way through frees just what was loaded
+    for(i = 0; ok && i < count; i++) {
         
-        //Do the next step of z-interpolation along x
-		if(x0 == x1)
-            return;
-            
-		te = err;
+        ok = read_box(&(map->sectors[i].bounds), f) &&
+             fread(&(map->sectors[i].first_portal), sizeof(int), 1, f) == 1 &&
+             fread(&(map->sectors[i].portal_count), sizeof(int), 1, f) == 1 &&
+             read_bsp(&(map->sectors[i].geometry), f);
+             
+        if(ok)
+            map->sector_count++;
+    }
+    
+    fclose(f);
+    
+    if(!ok)
+        free_sector_map(map);
         
-		if(te > -dx) {
-            
-            err -= dz;
-            x0 += sx;
-            z_addr +=sx;
-        } 
+    return ok;
+}
+
+//The sector the camera is standing in, or -1 if it's outside all of them
+int find_sector(sector_map *map, camera *cam) {
+    
+    int i;
+    box *b;
+    
+    for(i = 0; i < map->sector_count; i++) {
         
-		if(te < dz) {
-            
-            err += dx;
-            z0 += sz; 
-        }
+        b = &(map->sectors[i].bounds);
+        
+        if(cam->x >= b->min[0] && cam->x <= b->max[0] && cam->y >= b->min[1] && cam->y <= b->max[1] &&
+           cam->z >= b->min[2] && cam->z <= b->max[2])
+            return i;
     }
+    
+    return -1;
 }
 
-/*
-void draw_triangle(SDL_Renderer *rend, triangle* tri) {
+//Narrow a scissor down to the screen rectangle a portal covers. Returns zero
+//if none of the portal can be seen through what's left of the scissor
+int portal_scissor(camera *cam, portal *p, rect *clip, rect *out) {
     
-    int i;
-    screen_point p[3];
-    float vec_a[3];
-    float vec_b[3];
-    float cross[3];
-    float mag;
-    float normal_angle;
-    float lighting_pct;
-    float r, g, b;
-    unsigned char f, s, t, e;
-    int dx_x1, sx_x1, dy_x1, sy_x1,	err_x1,	te_x1;
-	int dx_z1, sx_z1, dy_z1, sy_z1,	err_z1,	te_z1;
-	int dx_x2, sx_x2, dy_x2, sy_x2,	err_x2,	te_x2;
-	int dx_z2, sx_z2, dy_z2, sy_z2,	err_z2,	te_z2;
-	int dx_x3, sx_x3, dy_x3, sy_x3,	err_x3,	te_x3;
-	int dx_z3, sx_z3, dy_z3, sy_z3,	err_z3,	te_z3;
-	int current_s;
-	int cur_x1, cur_x2, cur_x3;
-	int cur_z1, cur_z2, cur_z3;
-    int x1y, x2y, x3y, z1y, z2y, z3y;
-    
-    //Don't draw the triangle if it's offscreen
-    if(tri->v[0].z < 0 && tri->v[1].z < 0 && tri->v[2].z < 0)
-        return;
+    vertex poly[2][PORTAL_MAX_VERTS + 1], corner;
+    screen_point sp;
+    float side, d[PORTAL_MAX_VERTS + 1], t;
+    int i, j, count = 0;
     
-    //Calculate the surface normal
-    //subtract 3 from 2 and 1, translating it to the origin
-    vec_a[0] = tri->v[0].x - tri->v[2].x;
-    vec_a[1] = tri->v[0].y - tri->v[2].y;
-    vec_a[2] = tri->v[0].z - tri->v[2].z;
-    vec_b[0] = tri->v[1].x - tri->v[2].x;
-    vec_b[1] = tri->v[1].y - tri->v[2].y;
-    vec_b[2] = tri->v[1].z - tri->v[2].z;
+    side = p->plane[0]*cam->x + p->plane[1]*cam->y + p->plane[2]*cam->z + p->plane[3];
     
-    //calculate the cross product using 1 as vector a and 2 as vector b
-    cross[0] = vec_a[1]*vec_b[2] - vec_a[2]*vec_b[1];
-    cross[1] = vec_a[2]*vec_b[0] - vec_a[0]*vec_b[2];
-    cross[2] = vec_a[0]*vec_b[1] - vec_a[1]*vec_b[0]; 
+    //Portals are only looked through from behind, toward the sector they
+    //lead to
+    if(side > 0)
+        return 0;
+        
+    //Right up against the portal its projection can't be trusted, but then
+    //it fills the view anyway
+    if(side > -NEAR_Z) {
+        
+        *out = *clip;
+        return 1;
+    }
     
-    //normalize the result vector
-    mag = sqrt(cross[0]*cross[0] + cross[1]*cross[1] + cross[2]*cross[2]);
-    cross[0] /= mag;
-    cross[1] /= mag;
-    cross[2] /= mag;
+    for(i = 0; i < p->count; i++) {
         
-    //Calculate the normal's angle vs the camera view direction
-    normal_angle = acos(-cross[2]);
+        corner.x = p->v[i][0];
+        corner.y = p->v[i][1];
+        corner.z = p->v[i][2];
+        corner.c = NULL;
+        transform_vertex(&(cam->view_proj), &corner, &(poly[0][i]));
+        d[i] = poly[0][i].z - NEAR_Z;
+    }
     
-    //If the normal is facing away from the camera, don't bother drawing it
-    if(normal_angle >= (3*PI/4)) {
+    //Cut off whatever is in front of the near plane
+    for(i = 0, j = p->count - 1; i < p->count; j = i++) {
         
-        return;
+        if((d[i] >= 0) != (d[j] >= 0)) {
+            
+            t = d[j] / (d[j] - d[i]);
+            poly[1][count].x = poly[0][j].x + t * (poly[0][i].x - poly[0][j].x);
+            poly[1][count].y = poly[0][j].y + t * (poly[0][i].y - poly[0][j].y);
+            poly[1][count++].z = NEAR_Z;
+        }
+        
+        if(d[i] >= 0)
+            poly[1][count++] = poly[0][i];
     }
     
-    //NOTE: We need to do some relatively easy math and clip all triangles to the front and rear planes
-    //should basically be testing each vertex's z component to see if it's less than zero or greater than 
-    //the screen depth and, if so, calculate the intersections of its connecting edges with the respective
-    //planes and create two new vertices at the intersection points. We should then proceed to draw the
-    //two new resultant triangles. 
-    //If two of the three are beyond the same plane, we can replace each with the intersection of their
-    //non-mutual edge and draw a single triangle.
-    //Should be able to do this by performing intersection check on each plane in turn?
-    //We can make this recursive:
-    //begin split_tri (one, two, three)
-    //    count = 0
-    //    check one with back (if out, count++ and mark out) 
-    //    check two with back (if out, count++ and mark out)
-    //    check three with back (if out, count++ and mark out)
-    //    switch count
-    //        1: get new back intersections a and b
-    //           split_tri(a, two, three) //actually make sure we build the right tri
-    //           split_tri(b, two, three) //same note
-    //           return
-    //        2: get new back intersections a and b //different from above for the aforementioned reasons
-    //           split_tri(a, b, three) //same note as always
-    //           return
-    //        0: //do nothing and flow through
-    //    endswitch
-    //    //Could probably shorten this by making two passes at the above while swapping planes
-    //    count = 0
-    //    check one with front (if out, count++ and mark out) 
-    //    check two with front (if out, count++ and mark out)
-    //    check three with front (if out, count++ and mark out)
-    //    switch count
-    //        1: get new front intersections a and b
-    //           split_tri(a, two, three) //actually make sure we build the right tri
-    //           split_tri(b, two, three) //same note
-    //           return
-    //        2: get new front intersections a and b //different from above for the aforementioned reasons
-    //           split_tri(a, b, three) //same note as always
-    //           return
-    //        0: //do nothing and flow through
-    //    endswitch
-    //    //There are no triangles out, so we can pass this one along
-    //    draw_triangle(one, two, three)
-    //end    
-    //
-    //Calculate the shading color based on the first vertex color and the
-    //angle between the camera and the surface normal
-    lighting_pct = 1.0 - (normal_angle/PI);
-    r = (float)tri->v[0].c->r * lighting_pct;
-    r = r > 255.0 ? 255 : r;     
-    g = (float)tri->v[0].c->g * lighting_pct;
-    g = g > 255.0 ? 255 : g;
-    b = (float)tri->v[0].c->b * lighting_pct;
-    b = b > 255.0 ? 255 : b;
-    SDL_SetRenderDrawColor(rend, (unsigned char)r, (unsigned char)g, (unsigned char)b, 0xFF);
-    
-    //Move the vertices from world space to screen space
-    for(i = 0; i < 3; i++) 
-        project(&(tri->v[i]), &p[i]);
+    if(count < 3)
+        return 0;
+        
+    out->x0 = SCREEN_WIDTH;
+    out->y0 = SCREEN_HEIGHT;
+    out->x1 = out->y1 = -1;
     
-    //sort vertices by ascending y
-    f = 0; s = 1; t = 2;
-    if(p[f].y > p[s].y) {
-        e = s;
-        s = f;
-        f = e;
-    }
-    if(p[s].y > p[t].y) {
-        e = t;
-        t = s;
-        s = e;
-    }
-    if(p[f].y > p[s].y) {
-        e = s;
-        s = f;
-        f = e;
+    for(i = 0; i < count; i++) {
+        
+        project(&(poly[1][i]), &sp);
+        out->x0 = sp.x < out->x0 ? sp.x : out->x0;
+        out->y0 = sp.y < out->y0 ? sp.y : out->y0;
+        out->x1 = sp.x > out->x1 ? sp.x : out->x1;
+        out->y1 = sp.y > out->y1 ? sp.y : out->y1;
     }
-                    
-    //Now that they're sorted, calculate the bresenham values for each line
-	//For the x of the first line ([x1, y1, z1] -> [x2, y2, z2])
-	dx_x1 = abs(p[s].x - p[f].x);
-	sx_x1 = p[f].x < p[s].x ? 1 : -1;
-	dy_x1 = abs(p[s].y - p[f].y);
-	sy_x1 = p[f].y < p[s].y ? 1 : -1; 
-	err_x1 = (dx_x1 > dy_x1 ? dx_x1 : -dy_x1) / 2;
-	te_x1;
-	
-	//For the z of the first line ([x1, y1, z1] -> [x2, y2, z2])
-	dx_z1 = abs(p[s].z - p[f].z);
-	sx_z1 = p[f].z < p[s].z ? 1 : -1;
-	dy_z1 = abs(p[s].y - p[f].y);
-	sy_z1 = p[f].y < p[s].y ? 1 : -1; 
-	err_z1 = (dx_z1 > dy_z1 ? dx_z1 : -dy_z1) / 2;
-	te_z1;
-	
-	//For the x of the second line ([x2, y2, z2] -> [x3, y3, z3])
-	dx_x2 = abs(p[t].x - p[s].x);
-	sx_x2 = p[s].x < p[t].x ? 1 : -1;
-	dy_x2 = abs(p[t].y - p[s].y);
-	sy_x2 = p[s].y < p[t].y ? 1 : -1; 
-	err_x2 = (dx_x2 > dy_x2 ? dx_x2 : -dy_x2) / 2;
-	te_x2;
-	
-	//For the z of the second line ([x2, y2, z2] -> [x3, y3, z3])
-	dx_z2 = abs(p[t].z - p[s].z);
-	sx_z2 = p[s].z < p[t].z ? 1 : -1;
-	dy_z2 = abs(p[t].y - p[s].y);
-	sy_z2 = p[s].y < p[t].y ? 1 : -1; 
-	err_z2 = (dx_z2 > dy_z2 ? dx_z2 : -dy_z2) / 2;
-	te_z2;
-	
-	//For the x of the third line ([x1, y1, z1] -> [x3, y3, z3])
-	dx_x3 = abs(p[t].x - p[f].x);
-	sx_x3 = p[f].x < p[t].x ? 1 : -1;
-	dy_x3 = abs(p[t].y - p[f].y);
-	sy_x3 = p[f].y < p[t].y ? 1 : -1; 
-	err_x3 = (dx_x3 > dy_x3 ? dx_x3 : -dy_x3) / 2;
-	te_x3;
-	
-	//For the z of the third line ([x1, y1, z1] -> [x3, y3, z3])
-	dx_z3 = abs(p[t].z - p[f].z);
-	sx_z3 = p[f].z < p[t].z ? 1 : -1;
-	dy_z3 = abs(p[t].y - p[f].y);
-	sy_z3 = p[f].y < p[t].y ? 1 : -1; 
-	err_z3 = (dx_z3 > dy_z3 ? dx_z3 : -dy_z3) / 2;
-	te_z3;
-	
-	//Set the important scanlines
-	current_s = p[f].y;
-	cur_x1 = p[f].x;
-	cur_z1 = p[f].z;
-	cur_x2 = p[s].x;
-	cur_z2 = p[s].z;;
-	cur_x3 = p[f].x;
-	cur_z3 = p[f].z;
-	
-	while(current_s < p[t].y) {
-		
-		//Run either line 1 or line 2
-		if(current_s < p[s].y) {
-			
-			//Draw the current scanline from line 1 to line 3
-			draw_scanline(rend, current_s, cur_x1, cur_z1, cur_x3, cur_z3);
-			
-			//Run the x of line 1 until we've stepped y
-			while(1) {
-				
-				te_x1 = err_x1;
-				
-				if (te_x1 > -dx_x1) {
-					
-					//x1-increase
-					err_x1 -= dy_x1;
-					cur_x1 += sx_x1;
-				}
-				
-				if (te_x1 < dy_x1) { 
-					
-					//s-increase
-					err_x1 += dx_x1;
-					break;
-				}
-			}
-			
-			//Run the z of line 1 until we've stepped y
-			while(1) {
-				
-				te_z1 = err_z1;
-				
-				if (te_z1 > -dx_z1) {
-					
-					//z1-increase
-					err_z1 -= dy_z1;
-					cur_z1 += sx_z1;
-				}
-				
-				if (te_z1 < dy_z1) { 
-					
-					//s-increase
-					err_z1 += dx_z1;
-					break;
-				}
-			}
-		} else {
-			
-			//Draw the current scanline from line 2 to line 3 
-			draw_scanline(rend, current_s, cur_x2, cur_z2, cur_x3, cur_z3);
-			
-			//Run the x of line 2 until we've stepped y
-			while(1) {
-				
-				te_x2 = err_x2;
-				                
-				if (te_x2 > -dx_x2) {
-					
-					//x2-increase
-					err_x2 -= dy_x2;
-					cur_x2 += sx_x2;
-				}
-				
-				if (te_x2 < dy_x2) { 
-					
-					//s-increase
-					err_x2 += dx_x2;
-					break;
-				}
-			}
-			
-			//Run the z of line 2 until we've stepped y
-			while(1) {
-				
-				te_z2 = err_z2;
-                				
-				if (te_z2 > -dx_z2) {
-					
-					//z2-increase
-					err_z2 -= dy_z2;
-					cur_z2 += sx_z2;
-				}
-				
-				if (te_z2 < dy_z2) { 
-					
-					//s-increase
-					err_z2 += dx_z2;
-					break;
-				}
-			}
-		}
-
-		//Run line 3		
-		//Run the x of line 3 until we've stepped y
-		while(1) {
-			
-			te_x3 = err_x3;
-			
-			if (te_x3 > -dx_x3) {
-				
-				//x3-increase
-				err_x3 -= dy_x3;
-				cur_x3 += sx_x3;
-			}
-			
-			if (te_x3 < dy_x3) { 
-				
-				//s-increase
-				err_x3 += dx_x3;
-				break;
-			}
-		}
-		
-		//Run the z of line 3 until we've stepped y
-		while(1) {
-			
-			te_z3 = err_z3;
-			
-			if (te_z3 > -dx_z3) {
-				
-				//z3-increase
-				err_z3 -= dy_z3;
-				cur_z3 += sx_z3;
-			}
-			
-			if (te_z3 < dy_z3) { 
-				
-				//s-increase
-				err_z3 += dx_z3;
-				break;
-			}
-		}
-		        
-		//Move to the next scanline		
-		current_s++;
-	}
-}
-*/
-
-void draw_triangle(SDL_Renderer *rend, triangle* tri) {
     
-    int i;
-    screen_point p[3];
-    float vec_a[3];
-    float vec_b[3];
-    float cross[3];
-    float mag;
-    float normal_angle;
-    float lighting_pct;
-    float r, g, b;
-    unsigned char f, s, t, e;
-    float dx_1, dx_2, dx_3, dy_1, dy_2,	dy_3, dz_1, dz_2, dz_3;
-    float mx_1, mx_2, mx_3, mz_1, mz_2, mz_3;
-    float new_x1, new_x2, new_x3, new_z1, new_z2, new_z3;
-    float first_orig_x, first_orig_y, first_orig_z, second_orig_x, second_orig_y, second_orig_z;
-	float current_s;
-    
-    //Don't draw the triangle if it's offscreen
-    if(tri->v[0].z < 0 && tri->v[1].z < 0 && tri->v[2].z < 0)
-        return;
+    //A pixel of slack on every side covers rounding in the projection
+    out->x0 = out->x0 - 1 < clip->x0 ? clip->x0 : out->x0 - 1;
+    out->y0 = out->y0 - 1 < clip->y0 ? clip->y0 : out->y0 - 1;
+    out->x1 = out->x1 + 1 > clip->x1 ? clip->x1 : out->x1 + 1;
+    out->y1 = out->y1 + 1 > clip->y1 ? clip->y1 : out->y1 + 1;
     
-    //Calculate the surface normal
-    //subtract 3 from 2 and 1, translating it to the origin
-    vec_a[0] = tri->v[0].x - tri->v[2].x;
-    vec_a[1] = tri->v[0].y - tri->v[2].y;
-    vec_a[2] = tri->v[0].z - tri->v[2].z;
-    vec_b[0] = tri->v[1].x - tri->v[2].x;
-    vec_b[1] = tri->v[1].y - tri->v[2].y;
-    vec_b[2] = tri->v[1].z - tri->v[2].z;
+    return out->x0 <= out->x1 && out->y0 <= out->y1;
+}
+
+//Draw the level, starting from the sector the camera is in. Only sectors in
+//its potentially visible set are considered, and each only inside the
+//screen area of the portals it's seen through. From outside the level there
+//is nothing to go on, so every sector is drawn
+void render_sectors(sector_map *map, camera *cam) {
     
-    //calculate the cross product using 1 as vector a and 2 as vector b
-    cross[0] = vec_a[1]*vec_b[2] - vec_a[2]*vec_b[1];
-    cross[1] = vec_a[2]*vec_b[0] - vec_a[0]*vec_b[2];
-    cross[2] = vec_a[0]*vec_b[1] - vec_a[1]*vec_b[0]; 
+    int i, j, index, head = 0, tail = 0, count = 0, cap, *queue, *order, *depth;
+    rect screen = {0, 0, SCREEN_WIDTH - 1, SCREEN_HEIGHT - 1}, narrow, *clips, *c;
+    unsigned char *row;
+    sector *sec;
+    portal *p;
     
-    //normalize the result vector
-    mag = sqrt(cross[0]*cross[0] + cross[1]*cross[1] + cross[2]*cross[2]);
-    cross[0] /= mag;
-    cross[1] /= mag;
-    cross[2] /= mag;
+    if(!map->pvs)
+        return;
         
-    //Calculate the normal's angle vs the camera view direction
-    normal_angle = acos(-cross[2]);
-    
-    //If the normal is facing away from the camera, don't bother drawing it
-    if(normal_angle >= (3*PI/4)) {
+    if((index = find_sector(map, cam)) < 0) {
         
+        for(i = 0; i < map->sector_count; i++)
+            render_bsp(&(map->sectors[i].geometry), cam);
+            
         return;
     }
     
-    //NOTE: We need to do some relatively easy math and clip all triangles to the front and rear planes
-    //should basically be testing each vertex's z component to see if it's less than zero or greater than 
-    //the screen depth and, if so, calculate the intersections of its connecting edges with the respective
-    //planes and create two new vertices at the intersection points. We should then proceed to draw the
-    //two new resultant triangles. 
-    //If two of the three are beyond the same plane, we can replace each with the intersection of their
-    //non-mutual edge and draw a single triangle.
-    //Should be able to do this by performing intersection check on each plane in turn?
-    //We can make this recursive:
-    //begin split_tri (one, two, three)
-    //    count = 0
-    //    check one with back (if out, count++ and mark out) 
-    //    check two with back (if out, count++ and mark out)
-    //    check three with back (if out, count++ and mark out)
-    //    switch count
-    //        1: get new back intersections a and b
-    //           split_tri(a, two, three) //actually make sure we build the right tri
-    //           split_tri(b, two, three) //same note
-    //           return
-    //        2: get new back intersections a and b //different from above for the aforementioned reasons
-    //           split_tri(a, b, three) //same note as always
-    //           return
-    //        0: //do nothing and flow through
-    //    endswitch
-    //    //Could probably shorten this by making two passes at the above while swapping planes
-    //    count = 0
-    //    check one with front (if out, count++ and mark out) 
-    //    check two with front (if out, count++ and mark out)
-    //    check three with front (if out, count++ and mark out)
-    //    switch count
-    //        1: get new front intersections a and b
-    //           split_tri(a, two, three) //actually make sure we build the right tri
-    //           split_tri(b, two, three) //same note
-    //           return
-    //        2: get new front intersections a and b //different from above for the aforementioned reasons
-    //           split_tri(a, b, three) //same note as always
-    //           return
-    //        0: //do nothing and flow through
-    //    endswitch
-    //    //There are no triangles out, so we can pass this one along
-    //    draw_triangle(one, two, three)
-    //end    
-    //
-    //Calculate the shading color based on the first vertex color and the
-    //angle between the camera and the surface normal
-    lighting_pct = 1.0 - (normal_angle/PI);
-    r = (float)tri->v[0].c->r * lighting_pct;
-    r = r > 255.0 ? 255 : r;     
-    g = (float)tri->v[0].c->g * lighting_pct;
-    g = g > 255.0 ? 255 : g;
-    b = (float)tri->v[0].c->b * lighting_pct;
-    b = b > 255.0 ? 255 : b;
-    SDL_SetRenderDrawColor(rend, (unsigned char)r, (unsigned char)g, (unsigned char)b, 0xFF);
-    
-    //Move the vertices from world space to screen space
-    for(i = 0; i < 3; i++) 
-        project(&(tri->v[i]), &p[i]);
+    //A sector can be seen along more than one path of portals, so first
+    //gather the screen area each is seen through as the box around all of
+    //them, then draw each just once. Sectors go back in the queue whenever
+    //their area grows, up to a limit on the walk as a whole
+    cap = map->sector_count * SECTOR_MAX_DEPTH + 1;
+    clips = (rect*)arena_alloc(&frame_arena, map->sector_count * sizeof(rect));
+    order = (int*)arena_alloc(&frame_arena, map->sector_count * sizeof(int));
+    depth = (int*)arena_alloc(&frame_arena, map->sector_count * sizeof(int));
+    queue = (int*)arena_alloc(&frame_arena, cap * sizeof(int));
     
-    //sort vertices by ascending y
-    f = 0; s = 1; t = 2;
-    if(p[f].y > p[s].y) {
-        e = s;
-        s = f;
-        f = e;
-    }
-    if(p[s].y > p[t].y) {
-        e = t;
-        t = s;
-        s = e;
-    }
-    if(p[f].y > p[s].y) {
-        e = s;
-        s = f;
-        f = e;
+    if(!clips || !order || !depth || !queue) {
+        
+        printf("[render_sectors] failed to allocate the portal walk\n");
+        return;
     }
-                    
-	//Set the important scanlines
-	current_s = p[f].y;
-	dx_1 = p[s].x - p[f].x;
-    dy_1 = p[s].y - p[f].y;
-    dz_1 = p[s].z - p[f].z;
-    dx_2 = p[t].x - p[s].x;
-    dy_2 = p[t].y - p[s].y;
-    dz_2 = p[t].z - p[s].z;
-    dx_3 = p[t].x - p[f].x;
-    dy_3 = p[t].y - p[f].y;
-    dz_3 = p[t].z - p[f].z;
-    mx_1 = dy_1 ? dx_1 / dy_1 : 0;
-    mz_1 = dy_1 ? dz_1 / dy_1 : 0;
-    mx_2 = dy_2 ? dx_2 / dy_2 : 0;
-    mz_2 = dy_2 ? dz_2 / dy_2 : 0;
-    mx_3 = dy_3 ? dx_3 / dy_3 : 0;
-    mz_3 = dy_3 ? dz_3 / dy_3 : 0; 
-    first_orig_x = p[f].x;
-    first_orig_y = p[f].y;
-    first_orig_z = p[f].z;
-    second_orig_x = p[s].x;
-    second_orig_y = p[s].y;
-    second_orig_z = p[s].z;
-	
-	while(current_s < p[t].y) {
-		
-        if(!(current_s >= SCREEN_HEIGHT || current_s < 0)) {
-            
-            new_x3 = mx_3*(current_s - first_orig_y) + first_orig_x;
-            new_z3 = mz_3*(current_s - first_orig_y) + first_orig_z;
-            
-            if(current_s < p[s].y) {
-                
-                new_x1 = mx_1*(current_s - first_orig_y) + first_orig_x;
-                new_z1 = mz_1*(current_s - first_orig_y) + first_orig_z;
-                
-                //Draw the scanline from the first edge to the third 
-                draw_scanline(rend, current_s, new_x1, new_z1, new_x3, new_z3);
-            } else {
-                
-                new_x2 = mx_2*(current_s - second_orig_y) + second_orig_x;
-                new_z2 = mz_2*(current_s - second_orig_y) + second_orig_z;
-                
-                //Draw the scanline from the second edge to the third 
-                draw_scanline(rend, current_s, new_x2, new_z2, new_x3, new_z3);
-            }
-        }
-           
-		//Move to the next scanline		
-		current_s += 1;
-	}
-}
-
-void clip_and_render(SDL_Renderer *r, triangle* tri) {    
-
-    int count;
-    int on_second_iteration = 0;
-    int i;
-    float plane_z = 0.1;
-    float scale_factor, dx, dy, dz, ndz;
-    unsigned char point_marked[3] = {0, 0, 0};
-    vertex new_point[2]; 
-    triangle out_triangle[2];
-    int fixed[2];
-    int original;
     
+    for(i = 0; i < map->sector_count; i++)
+        depth[i] = -1;
+        
+    row = &(map->pvs[index * map->pvs_stride]);
+    clips[index] = screen;
+    depth[index] = 0;
+    order[count++] = index;
+    queue[tail++] = index;
     
-    //Note that in the future we're also going to need to clip on the
-    //'U', 'V' and color axes
-    while(1) {
+    while(head < tail) {
         
-        count = 0;
+        i = queue[head++];
+        sec = &(map->sectors[i]);
         
-        //Check each point to see if it's greater than the plane
-        for(i = 0; i < 3; i++) {
-            
-            if((on_second_iteration && tri->v[i].z > plane_z) || 
-              (!on_second_iteration && tri->v[i].z < plane_z)) {
-
-                point_marked[i] = 1;
-                count++;
-            } else {
-                
-                point_marked[i] = 0;
-            }
-        }
+        if(depth[i] == SECTOR_MAX_DEPTH)
+            continue;
             
-        switch(count) {
+        for(j = sec->first_portal; j < sec->first_portal + sec->portal_count; j++) {
             
-            //If all of the vertices were out of range, 
-            //skip drawing the whole thing entirely
-            case 3:
-                return;
-                break;
+            p = &(map->portals[j]);
             
-            //If one vertex was out, find it's edge intersections and
-            //build two new triangles out of it
-            case 1:
-                //Figure out what the other two points are
-                fixed[0] = point_marked[0] ? point_marked[1] ? 2 : 1 : 0;
-                fixed[1] = fixed[0] == 0 ? point_marked[1] ? 2 : 1 : fixed[0] == 1 ? point_marked[0] ? 2 : 0 : point_marked[0] ? 1 : 0;
-                original = point_marked[0] ? 0 : point_marked[1] ? 1 : 2;
-                
-                //Calculate the new intersection points
-                for(i = 0; i < 2; i++) {
-                    
-                    //x,y, and z 'length'
-                    dx = tri->v[original].x - tri->v[fixed[i]].x;
-                    dy = tri->v[original].y - tri->v[fixed[i]].y;
-                    dz = tri->v[original].z - tri->v[fixed[i]].z;
-                                       
-                    //Set the known axis value
-                    new_point[i].z = plane_z; //Replace this with a line function
-                    
-                    //z 'length' of new point
-                    ndz = new_point[i].z - tri->v[fixed[i]].z;
-                    
-                    //ratio of new y-length to to old
-                    scale_factor = ndz/dz; //For now, we're dealing with a plane orthogonal to the clipping axis and as such 
-                                           //we can't possibly have zero dy because that would place both the 'in' and 'out'
-                                           //vertexes behind the plane, which is obviously impossible, so we won't worry about
-                                           //that case until we start playing with sloped clipping planes
-                    
-                    //Scale the independent axis value by the scaling factor
-                    //We can do this for other arbitrary axes in the future, such as U and V
-                    new_point[i].x = scale_factor * dx + tri->v[fixed[i]].x;
-                    new_point[i].y = scale_factor * dy + tri->v[fixed[i]].y;
-                    
-                    //Copy the color information
-                    new_point[i].c = tri->v[fixed[i]].c;
-                }   
+            if(!(row[p->to / 8] & (1 << (p->to % 8))))
+                continue;
                 
-                //Test/draw the new triangles, maintaining the CW or CCW ordering
-                //Build the first triangle
-                clone_vertex(&new_point[0], &(out_triangle[0].v[original]));
-                clone_vertex(&(tri->v[fixed[0]]), &(out_triangle[0].v[fixed[0]]));
-                clone_vertex(&(tri->v[fixed[1]]), &(out_triangle[0].v[fixed[1]]));
-                    
-                //Build the second triangle    
-                clone_vertex(&new_point[1], &(out_triangle[1].v[original]));
-                clone_vertex(&new_point[0], &(out_triangle[1].v[fixed[0]]));
-                clone_vertex(&(tri->v[fixed[1]]), &(out_triangle[1].v[fixed[1]]));
-                
-                //Run the new triangles through another round of processing
-                clip_and_render(r, &out_triangle[0]);
-                clip_and_render(r, &out_triangle[1]);
+            if(!portal_scissor(cam, p, &clips[i], &narrow))
+                continue;
                 
-                //Exit the function early for dat tail recursion              
-                return;
-                break;
+            c = &clips[p->to];
             
-            case 2:
-                //Figure out which point we're keeping
-                original = point_marked[0] ? point_marked[1] ? 2 : 1 : 0;
-                fixed[0] = point_marked[0] ? 0 : point_marked[1] ? 1 : 2;
-                fixed[1] = fixed[0] == 0 ? point_marked[1] ? 1 : 2 : fixed[0] == 1 ? point_marked[0] ? 0 : 2 : point_marked[0] ? 0 : 1;
-                            
-                //Calculate the new intersection points
-                for(i = 0; i < 2; i++) {
-                    
-                    //x,y, and z 'length'
-                    dx = tri->v[original].x - tri->v[fixed[i]].x;
-                    dy = tri->v[original].y - tri->v[fixed[i]].y;
-                    dz = tri->v[original].z - tri->v[fixed[i]].z;
-                                       
-                    //Set the known axis value
-                    new_point[i].z = plane_z; //Replace this with a line function
-                    
-                    //z 'length' of new point
-                    ndz = new_point[i].z - tri->v[fixed[i]].z;
-                    
-                    //ratio of new y-length to to old
-                    scale_factor = ndz/dz; //For now, we're dealing with a plane orthogonal to the clipping axis and as such 
-                                           //we can't possibly have zero dy because that would place both the 'in' and 'out'
-                                           //vertexes behind the plane, which is obviously impossible, so we won't worry about
-                                           //that case until we start playing with sloped clipping planes
-                    
-                    //Scale the independent axis value by the scaling factor
-                    //We can do this for other arbitrary axes in the future, such as U and V
-                    new_point[i].x = scale_factor * dx + tri->v[fixed[i]].x;
-                    new_point[i].y = scale_factor * dy + tri->v[fixed[i]].y;
-                    
-                    //Copy the color information
-                    new_point[i].c = tri->v[fixed[i]].c;
-                }      
+            //The queue is walked breadth first, so a sector is first reached
+            //along the fewest portals and gets drawn in that order, nearer
+            //sectors before the ones seen through them
+            if(depth[p->to] < 0) {
                 
-                //Start building the new triangles, maintaining the CW or CCW ordering 
-                clone_vertex(&(tri->v[original]), &(out_triangle[0].v[original]));
-                clone_vertex(&new_point[0], &(out_triangle[0].v[fixed[0]]));
-                clone_vertex(&new_point[1], &(out_triangle[0].v[fixed[1]]));
+                *c = narrow;
+                depth[p->to] = depth[i] + 1;
+                order[count++] = p->to;
+            } else if(narrow.x0 >= c->x0 && narrow.y0 >= c->y0 && narrow.x1 <= c->x1 && narrow.y1 <= c->y1) {
                 
-                //Send through processing again
-                clip_and_render(r, &out_triangle[0]);
-                    
-                //Exit the function early for dat tail recursion  
-                return;
-                break;
+                continue;
+            } else {
+                
+                c->x0 = narrow.x0 < c->x0 ? narrow.x0 : c->x0;
+                c->y0 = narrow.y0 < c->y0 ? narrow.y0 : c->y0;
+                c->x1 = narrow.x1 > c->x1 ? narrow.x1 : c->x1;
+                c->y1 = narrow.y1 > c->y1 ? narrow.y1 : c->y1;
+            }
             
-            //If there were no intersections we won't do anything and 
-            //allow execution to flow through
-            case 0:
-            default:
-                break; 
+            if(tail < cap)
+                queue[tail++] = p->to;
         }
-
-        //If we hit case 0 both times above, all points on this
-        //triangle lie in the drawable area and we can leave this
-        //clipping loop and flow down to do the drawing of the 
-        //processed triangle         
-        if(on_second_iteration)
-            break;
-        
-        on_second_iteration = 1;
-        plane_z = SCREEN_DEPTH;
-    }    
-    
-    //If we got this far, the triangle is drawable. So we should do that. Or whatever.
-    draw_triangle(r, tri);   
-}
-
-void render_triangle(SDL_Renderer *rend, triangle* tri) {
-
-    clip_and_render(rend, tri);
-}
-
-void render_object(SDL_Renderer *r, object *obj) {
-    
-    node* item;
-    int i;
+    }
     
-    list_for_each(&(obj->tri_list), item, i) {
+    for(i = 0; i < count; i++) {
         
-        render_triangle(r, (triangle*)item->payload);
+        set_scissor(&clips[order[i]]);
+        render_bsp(&(map->sectors[order[i]].geometry), cam);
     }
+    
+    set_scissor(&screen);
 }
 
 int main(int argc, char* argv[]) {
 
     SDL_Window* window = NULL;
     SDL_Renderer* renderer = NULL;
+    SDL_Texture* screen_tex = NULL;
     SDL_Event e;
     int fov_angle, player_angle = 90, chg_angle = 0;
     float i = 0.0, step = 0, rstep = 0, fps, walkspeed = 0.04;
     color *c;
     object *cube1, *cube2;
+    scene world;
+    sector_map level;
+    camera cam;
     triangle test_tri[2];
     int done = 0;
     int numFrames = 0; 
@@ -1250,6 +5710,15 @@ int main(int argc, char* argv[]) {
         return -1;
     }
 
+    if(!init_fbuf()) {
+        
+        printf("Could not init the framebuffer\n");
+        return -1;
+    }
+
+    init_arena(&scene_arena, SCENE_ARENA_BLOCK);
+    init_arena(&frame_arena, FRAME_ARENA_BLOCK);
+
     if(!(c = new_color(50, 200, 255, 255))) {
         
         printf("Could not allocate a new color\n");
@@ -1271,9 +5740,71 @@ int main(int argc, char* argv[]) {
     }
 
     printf("Cube created successfully\n");
+    
+    //Textures have to be made before a level that uses them is loaded
+    if(!(cube1->tex = new_checker_texture(6, TO_PIXEL(200, 200, 200), TO_PIXEL(90, 60, 40)))) {
+        
+        printf("Could not create the texture\n");
+        return -1;
+    }
+    
+    //The big cube is the static environment, as a level of one sector. It
+    //comes from a compiled sector file if one is given, and is otherwise
+    //compiled on the spot, in which case -c <file> just writes that out and
+    //quits
+    translate_object(cube1, 0.0, -3.0, 2.0);
+    init_sector_map(&level);
+    
+    if(argc == 2) {
+        
+        if(!load_sectors(&level, argv[1])) {
+            
+            printf("Could not load the level from %s\n", argv[1]);
+            return -1;
+        }
+    } else if(add_sector(&level, cube1) < 0 || !build_pvs(&level)) {
+        
+        printf("Could not compile the level\n");
+        return -1;
+    }
+    
+    printf("Level has %d sectors and %d portals\n", level.sector_count, level.portal_count);
+    
+    if(argc == 3 && !strcmp(argv[1], "-c")) {
+        
+        if(!save_sectors(&level, argv[2])) {
+            
+            printf("Could not write the level to %s\n", argv[2]);
+            return -1;
+        }
+        
+        printf("Wrote the level to %s\n", argv[2]);
+        free_sector_map(&level);
+        arena_free(&scene_arena);
+        arena_free(&frame_arena);
+        return 0;
+    }
+    
+    init_scene(&world);
+    
+    if(!add_to_scene(&world, cube2)) {
+        
+        printf("Could not add the cube to the scene\n");
+        return -1;
+    }
+
+    init_span_kernel();
+    init_setup_kernel();
+    
+    if(!init_workers()) {
+        
+        printf("Could not start the rasterizer threads\n");
+        return -1;
+    }
 
     fov_angle = 50;
     focal_length = 1.0 / (2.0 * tan(DEG_TO_RAD(fov_angle)/2.0));
+    init_camera(&cam);
 
     if(SDL_Init(SDL_INIT_VIDEO) < 0) {
 
@@ -1297,10 +5828,18 @@ int main(int argc, char* argv[]) {
         return -1;
     }
 
+    //The whole frame is drawn into fbuf and uploaded to this in one go
+    screen_tex = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, SCREEN_WIDTH, SCREEN_HEIGHT);
+
+    if(screen_tex == NULL) {
+
+        printf("Screen texture could not be created! SDL_Error: %s\n", SDL_GetError());
+        return -1;
+    }
+
     //SDL_SetWindowFullscreen(window, SDL_WINDOW_FULLSCREEN);
     SDL_SetRelativeMouseMode(SDL_TRUE);
 
-    translate_object(cube1, 0.0, -3.0, 2.0);
     translate_object(cube2, 0.0, 0.0, 2.0);
     //rotate_object_y_local(cube, 45);
     //rotate_object_x_local(cube, 45);
@@ -1364,6 +5903,35 @@ int main(int argc, char* argv[]) {
                         rstep = walkspeed;
                     break;
                     
+                    case SDLK_TAB:
+                        
+                        raster_mode = (raster_mode + 1) % RASTER_MODE_COUNT;
+                        printf("Raster engine: %s\n", raster_mode_name[raster_mode]);
+                    break;
+                    
+                    case SDLK_s:
+                        
+                        hsr_mode = (hsr_mode + 1) % HSR_MODE_COUNT;
+                        printf("Static scenery: %s\n", hsr_mode_name[hsr_mode]);
+                    break;
+                    
+                    case SDLK_v:
+                        
+                        shade_mode = (shade_mode + 1) % SHADE_MODE_COUNT;
+                        printf("Shading: %s\n", shade_mode_name[shade_mode]);
+                    break;
+                    
+                    case SDLK_g:
+                        
+                        light_mode = (light_mode + 1) % LIGHT_MODE_COUNT;
+                        printf("Lighting: %s\n", light_mode_name[light_mode]);
+                    break;
+                    
+                    case SDLK_c:
+                        
+                        print_surface_cache();
+                    break;
+                    
                     default:
                         done = 1;
                         break;
@@ -1393,15 +5961,17 @@ int main(int argc, char* argv[]) {
         }
 
         frame_start = SDL_GetTicks();
+        arena_reset(&frame_arena);
         i += step;
         //translate_object(cube1, 0.0, 0.0, step);
         //rotate_object_y_local(cube1, 1);
         //rotate_object_x_local(cube1, 1);
         //rotate_object_z_local(cube1, 1);        
-        rotate_object_y_global(cube2, -chg_angle);    
-        translate_object(cube2, -rstep, 0.0, -step);
-        rotate_object_y_global(cube1, -chg_angle);
-        translate_object(cube1, -rstep, 0.0, -step);
+        
+        //The world stays put and the camera moves through it instead
+        cam.yaw += chg_angle;
+        move_camera(&cam, rstep, step);
+        update_camera(&cam);
         //rotate_object_x_local(cube2, 1);
         //rotate_object_z_local(cube2, 1);
 
@@ -1414,24 +5984,39 @@ int main(int argc, char* argv[]) {
         if(player_angle == -1)
             player_angle = 359;
 
-        SDL_SetRenderDrawColor(renderer, 0xFF, 0xFF, 0x00, 0xFF);
-        SDL_RenderClear(renderer);
-        clear_zbuf();
+        begin_frame(TO_PIXEL(0xFF, 0xFF, 0x00));
         
-        render_object(renderer, cube1);
-        render_object(renderer, cube2);  
-        //render_triangle(renderer, &test_tri[0]);
-        //render_triangle(renderer, &test_tri[1]);
+        //The environment goes first, and gets drawn before anything else
+        //is walked so the occlusion tests can use it
+        render_sectors(&level, &cam);
+        render_bins();
+        render_scene(&world, &cam);
+        render_bins();
+        //render_triangle(&test_tri[0]);
+        //render_triangle(&test_tri[1]);
         
+        //Push the finished frame out to the window
+        finish_frame();
+        SDL_UpdateTexture(screen_tex, NULL, (void*)fbuf, SCREEN_WIDTH*4);
+        SDL_RenderCopy(renderer, screen_tex, NULL, NULL);
         SDL_RenderPresent(renderer);
         numFrames++;        
         fps = ( numFrames/(float)(SDL_GetTicks() - startTime) )*1000;
-        sprintf(&title, "LESTER %f FPS", fps);
+        sprintf(&title, "LESTER %f FPS [%s, %s, %s, %s]", fps, raster_mode_name[raster_mode], hsr_mode_name[hsr_mode], shade_mode_name[shade_mode], light_mode_name[light_mode]);
         SDL_SetWindowTitle(window, &title);
         
         //while((SDL_GetTicks() - frame_start) <= 14);
     }
 
+    shutdown_workers();
+    print_surface_cache();
+    free_surface_cache();
+    free(vis_setups);
+    free_scene(&world);
+    free_sector_map(&level);
+    arena_free(&frame_arena);
+    arena_free(&scene_arena);
+    SDL_DestroyTexture(screen_tex);
     SDL_DestroyRenderer(renderer);
     SDL_DestroyWindow(window);
     SDL_Quit();